@@ -0,0 +1,444 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+// Frames between publishers and info_calc.
+// It's shared by the projects with lib_extra_dirs.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+#define FRAME_MAGIC             0xC5
+#define FRAME_TAG_LEN           8
+#define FRAME_KEY_LEN           16
+#define MAX_FRAME_LEN           250
+
+typedef enum
+{
+    // payload: "ch,value,unit"
+    FrameValue = 1,
+    // payload: AckPayload
+    FrameAck = 2,
+    // payload: TimePayload
+    FrameTime = 3,
+    // payload: ControlHeader and ControlItems, from an admin publisher
+    FrameControl = 4,
+    // payload: ControlReply, info_calc returns it for a control frame
+    FrameControlReply = 5,
+    // payload: MetricsPayload, info_calc broadcasts it periodically
+    FrameMetrics = 6,
+} FrameType;
+
+struct __attribute__((packed)) FrameHeader {
+    uint8_t magic;
+    uint8_t type;
+    uint32_t seq;
+};
+
+// info_calc returns it to the sender after it applied a value frame.
+struct __attribute__((packed)) AckPayload {
+    // the sequence number of the last applied frame.
+    uint32_t seq;
+};
+
+// A time beacon, so that info_calc keeps the time without a router.
+struct __attribute__((packed)) TimePayload {
+    // UTC in us when the beacon handed the frame to the radio.
+    int64_t epoch_us;
+    // how far the clock of the beacon may be off.
+    uint32_t error_ms;
+};
+
+// Parameters of info_calc which an admin publisher can change at runtime.
+typedef enum
+{
+    // ms to show a channel in the rotation
+    ParamRoundingInterval = 1,
+    // ms until a value is dropped
+    ParamInvalidDataInterval = 2,
+    // 1 to 255 of the LED matrix
+    ParamBrightness = 3,
+    // of all pushers, 0 to use the key map
+    ParamMaxSpeed = 4,
+    ParamMaxAccel = 5,
+    ParamHoldTime = 6,
+    // of the channel in the index
+    ParamPriority = 7,
+    ParamStalenessWeight = 8,
+    ParamMinDwell = 9,
+    ParamShowOnChange = 10,
+} ConfigParam;
+
+// Store the change into NVS, so that it's kept after reboot.
+#define CONTROL_PERSIST         0x01
+#define MAX_CONTROL_ITEMS       32
+
+// All items of a control frame are applied together or none of them.
+struct __attribute__((packed)) ControlHeader {
+    // The revision the admin has seen. It must be the active one, so a retried or replayed
+    // change is stale after it's applied, whichever MAC sends it again.
+    uint32_t base_revision;
+    uint8_t flags;
+    uint8_t count;
+};
+
+struct __attribute__((packed)) ControlItem {
+    uint8_t param;
+    uint8_t index;
+    int32_t value;
+};
+
+typedef enum
+{
+    ControlApplied = 0,
+    // The revision has changed since base_revision.
+    ControlStale = 1,
+    // An item is unknown or out of range.
+    ControlInvalid = 2,
+    // It's applied but not stored.
+    ControlNotStored = 3,
+} ControlStatus;
+
+struct __attribute__((packed)) ControlReply {
+    // the sequence number of the control frame
+    uint32_t seq;
+    // the revision after the frame
+    uint32_t revision;
+    uint8_t status;
+    // the index of the invalid item
+    uint8_t item;
+};
+
+// Returns the number of the items, or -1 if the length doesn't match.
+static inline int control_item_count(const uint8_t *data, int len, ControlHeader *header)
+{
+    if (len < (int)sizeof(ControlHeader)) { return -1; }
+    memcpy(header, data, sizeof(*header));
+    if (header->count > MAX_CONTROL_ITEMS) { return -1; }
+    if (len != (int)(sizeof(ControlHeader) + header->count * sizeof(ControlItem))) { return -1; }
+    return header->count;
+}
+
+#define METRICS_VERSION         1
+// loop() iterations under 1, 2, 4, ... 64 ms and longer
+#define METRICS_LATENCY_BUCKETS 8
+#define METRICS_CHANNELS        8
+
+struct __attribute__((packed)) ChannelMetrics {
+    uint8_t ch;
+    // recent frames, halved as they grow
+    uint16_t received;
+    uint16_t lost;
+    // dBm, or 0 if unknown
+    int8_t rssi;
+};
+
+// The health of an info_calc. The counts are since the last report unless noted.
+// Add fields at the end and count up METRICS_VERSION.
+struct __attribute__((packed)) MetricsPayload {
+    uint8_t version;
+    uint32_t uptime_s;
+    uint32_t interval_ms;
+    uint32_t config_revision;
+    uint16_t loop_latency[METRICS_LATENCY_BUCKETS];
+    uint16_t max_loop_ms;
+    // of all displays
+    uint32_t presses;
+    uint16_t presses_per_hour;
+    // since boot
+    uint16_t resyncs;
+    uint16_t drifts;
+    uint32_t heap_free;
+    // the lowest since boot
+    uint32_t heap_min;
+    // free stack in bytes, the lowest since boot
+    uint16_t stack_radio;
+    uint16_t stack_actuator;
+    uint16_t stack_led;
+    uint16_t stack_loop;
+    uint16_t stack_light;
+    // frames dropped by the full queue and rejected before parsing, since boot
+    uint32_t queue_dropped;
+    uint32_t rejected;
+    // Some channels in each report. They go around all channels in turn.
+    uint8_t channel_count;
+    ChannelMetrics channels[METRICS_CHANNELS];
+};
+
+// ESP-NOW sends at 1 Mbps: the preamble, then the payload in a vendor specific action frame.
+#define ESPNOW_PREAMBLE_US      192
+#define ESPNOW_OVERHEAD_LEN     43
+
+// Time in us to put a frame on the air. The receiver of a beacon adds it to the time.
+static inline uint32_t frame_airtime_us(size_t len)
+{
+    return ESPNOW_PREAMBLE_US + (uint32_t)(len + ESPNOW_OVERHEAD_LEN) * 8;
+}
+
+// A value frame is text: "ch,value,unit".
+// Values are fixed point in hundredths of the unit from here on, e.g. 23.45 °C is 2345.
+// The calculator shows every unit with two decimals, so all units have the same scale.
+#define VALUE_SCALE             100
+#define VALUE_DECIMALS          2
+// The integer part fits int32_t in hundredths.
+#define MAX_VALUE_DIGITS        7
+#define MAX_UNIT_LEN            15
+
+struct ValuePayload {
+    uint16_t ch;
+    // in hundredths
+    int32_t value;
+    char unit[MAX_UNIT_LEN + 1];
+};
+
+// Parses a value payload without sscanf() nor floats. It never reads past len nor writes past the unit.
+// The value is a decimal number like "-12.345". It's rounded half away from zero to hundredths.
+// The unit may be empty. Returns false for anything else.
+static inline bool parse_value_payload(const uint8_t *data, int len, ValuePayload *out)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = data + (len > 0 ? len : 0);
+    int digits = 0;
+
+    // channel
+    uint32_t ch = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        ch = ch * 10 + (*p++ - '0');
+        if (++digits > 5 || ch > 0xffff) { return false; }
+    }
+    if (digits == 0 || p >= end || *p++ != ',') { return false; }
+
+    // value
+    while (p < end && *p == ' ') { p++; }
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p++ == '-';
+    }
+    int32_t integer = 0;
+    int32_t fraction = 0;
+    bool round_up = false;
+    int decimals = -1;
+    digits = 0;
+    for (; p < end; p++) {
+        if (*p == '.' && decimals < 0) {
+            decimals = 0;
+            continue;
+        }
+        if (*p < '0' || *p > '9') { break; }
+        int n = *p - '0';
+        digits++;
+        if (decimals < 0) {
+            if (digits > MAX_VALUE_DIGITS) { return false; }
+            integer = integer * 10 + n;
+        } else {
+            if (decimals < VALUE_DECIMALS) {
+                fraction = fraction * 10 + n;
+            } else
+            if (decimals == VALUE_DECIMALS) {
+                round_up = n >= 5;
+            }
+            decimals++;
+        }
+    }
+    if (digits == 0) { return false; }
+    for (int i = decimals < 0 ? 0 : decimals; i < VALUE_DECIMALS; i++) {
+        fraction *= 10;
+    }
+    int32_t value = integer * VALUE_SCALE + fraction + (round_up ? 1 : 0);
+
+    // unit
+    int n = 0;
+    if (p < end && *p != '\0' && *p != '\n' && *p != '\r') {
+        if (*p++ != ',') { return false; }
+        for (; p < end && *p > ' ' && *p != 0x7f; p++) {
+            if (n >= MAX_UNIT_LEN) { return false; }
+            out->unit[n++] = *p;
+        }
+    }
+    // Only a terminator can follow.
+    if (p < end && *p != '\0' && *p != '\n' && *p != '\r') { return false; }
+
+    out->unit[n] = '\0';
+    out->ch = ch;
+    out->value = negative ? -value : value;
+    return true;
+}
+
+// Formats a value payload. Returns the length like snprintf().
+static inline int format_value_payload(char *buf, size_t cap, uint16_t ch, int32_t value, const char *unit)
+{
+    uint32_t magnitude = value < 0 ? -(uint32_t)value : value;
+    return snprintf(buf, cap, "%u,%s%lu.%02lu,%s", ch, value < 0 ? "-" : "",
+                    (unsigned long)(magnitude / VALUE_SCALE), (unsigned long)(magnitude % VALUE_SCALE), unit);
+}
+
+// Frames are sealed with it when SECURE_ESPNOW isn't defined.
+// The tag only detects broken frames then.
+static const uint8_t frame_open_key[FRAME_KEY_LEN] = { 0 };
+
+// A paired peer and its local master key.
+// The key also authenticates the frames from the peer.
+struct PeerKey {
+    uint8_t mac[6];
+    uint8_t lmk[FRAME_KEY_LEN];
+};
+
+#define SIP_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) \
+    do { \
+        v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+        v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+    } while (0)
+
+static inline uint64_t sip_load64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+// SipHash-2-4. It's cheap enough to check every frame in the receive callback.
+static inline uint64_t siphash24(const uint8_t *key, const uint8_t *data, size_t len)
+{
+    uint64_t k0 = sip_load64(key);
+    uint64_t k1 = sip_load64(key + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    const uint8_t *end = data + len - (len % 8);
+    uint64_t m;
+
+    for (; data != end; data += 8) {
+        m = sip_load64(data);
+        v3 ^= m;
+        SIP_ROUND(v0, v1, v2, v3);
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    m = (uint64_t)len << 56;
+    for (int i = (int)(len % 8) - 1; i >= 0; i--) {
+        m |= (uint64_t)data[i] << (i * 8);
+    }
+    v3 ^= m;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; i++) {
+        SIP_ROUND(v0, v1, v2, v3);
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Builds a frame: header, payload and tag. Returns the length or 0 if it doesn't fit.
+static inline size_t frame_seal(uint8_t *buf, size_t cap, uint8_t type, uint32_t seq,
+                                const void *payload, size_t len, const uint8_t *key)
+{
+    size_t total = sizeof(FrameHeader) + len + FRAME_TAG_LEN;
+    if (total > cap || total > MAX_FRAME_LEN) { return 0; }
+
+    FrameHeader header = { FRAME_MAGIC, type, seq };
+    memcpy(buf, &header, sizeof(header));
+    memcpy(buf + sizeof(header), payload, len);
+    uint64_t tag = siphash24(key, buf, sizeof(header) + len);
+    memcpy(buf + sizeof(header) + len, &tag, FRAME_TAG_LEN);
+    return total;
+}
+
+// Checks the size and the magic only. Returns false for junk.
+static inline bool frame_peek(const uint8_t *data, int len, FrameHeader *header)
+{
+    if (len < (int)(sizeof(FrameHeader) + FRAME_TAG_LEN) || len > MAX_FRAME_LEN) { return false; }
+    if (data[0] != FRAME_MAGIC) { return false; }
+    memcpy(header, data, sizeof(FrameHeader));
+    return true;
+}
+
+// Checks the tag. Returns the length of the payload, or -1.
+static inline int frame_verify(const uint8_t *data, int len, const uint8_t *key, const uint8_t **payload)
+{
+    int body = len - FRAME_TAG_LEN;
+    uint64_t tag = siphash24(key, data, body);
+    uint64_t received;
+    memcpy(&received, data + body, FRAME_TAG_LEN);
+    if (tag != received) { return -1; }
+
+    *payload = data + sizeof(FrameHeader);
+    return body - sizeof(FrameHeader);
+}
+
+// Rejects replayed frames. It accepts sequence numbers up to 32 behind the highest one.
+class ReplayWindow
+{
+private:
+    uint32_t _highest = 0;
+    uint32_t _bitmap = 0;
+    bool _started = false;
+
+public:
+
+    bool check(uint32_t seq) const
+    {
+        if (_started == false || (int32_t)(seq - _highest) > 0) { return true; }
+        uint32_t behind = _highest - seq;
+        if (behind >= 32) { return false; }
+        return ((_bitmap >> behind) & 1) == 0;
+    }
+
+    void accept(uint32_t seq)
+    {
+        if (_started == false) {
+            _started = true;
+            _highest = seq;
+            _bitmap = 1;
+            return;
+        }
+        int32_t ahead = (int32_t)(seq - _highest);
+        if (ahead > 0) {
+            _bitmap = ahead >= 32 ? 0 : _bitmap << ahead;
+            _bitmap |= 1;
+            _highest = seq;
+        } else {
+            _bitmap |= 1UL << (uint32_t)(-ahead);
+        }
+    }
+
+    uint32_t highest() const { return _highest; }
+    // false until the first frame is accepted.
+    bool started() const { return _started; }
+};
+
+#endif
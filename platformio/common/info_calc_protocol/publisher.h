@@ -0,0 +1,123 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+
+#ifndef _PUBLISHER_H_
+#define _PUBLISHER_H_
+
+#include "protocol.h"
+#include "reliable_sender.h"
+
+// The sequence numbers below the stored limit may have been sent, so a boot starts at the limit
+// and the sequence number never goes back however many frames a boot sends.
+// The limit is moved forward every SEQ_RESERVE frames to save writes to the flash.
+#define SEQ_RESERVE             4096
+
+// The sending side of a publisher: the sequence numbers, the sealed value frames
+// and the retransmission of the latest one.
+class Publisher
+{
+public:
+    // Stores the new limit of the sequence numbers, e.g. into EEPROM.
+    typedef void (*StoreLimit)(uint32_t limit);
+
+private:
+    const uint8_t *_key = frame_open_key;
+    uint32_t _seq = 0;
+    uint32_t _seq_limit = 0;
+    StoreLimit _store_limit = NULL;
+    ReliableSender::Transmit _transmit = NULL;
+    bool _reliable = false;
+    ReliableSender _sender;
+
+public:
+
+    // stored_limit is the limit read at boot.
+    void begin(const uint8_t *key, uint32_t stored_limit, StoreLimit store_limit,
+               ReliableSender::Transmit transmit, bool reliable)
+    {
+        // The flash is erased to 0xFF.
+        if (stored_limit == 0xFFFFFFFF) {
+            stored_limit = 0;
+        }
+        _key = key;
+        // next_seq() moves the limit forward at the first frame.
+        _seq = stored_limit;
+        _seq_limit = stored_limit;
+        _store_limit = store_limit;
+        _transmit = transmit;
+        _reliable = reliable;
+        _sender.begin(transmit);
+    }
+
+    ReliableSender *sender() { return &_sender; }
+
+    // Returns the sequence number of a new frame.
+    uint32_t next_seq()
+    {
+        if (_seq == _seq_limit) {
+            _seq_limit = _seq + SEQ_RESERVE;
+            _store_limit(_seq_limit);
+        }
+        return _seq++;
+    }
+
+    // value is in hundredths. It's sent again until info_calc acknowledges it if reliable.
+    void send_value(int ch, int32_t value, const char *unit, unsigned long now)
+    {
+        char str[64] = {};
+        uint8_t frame[MAX_FRAME_LEN];
+
+        format_value_payload(str, sizeof(str), ch, value, unit);
+        uint32_t frame_seq = next_seq();
+        size_t len = frame_seal(frame, sizeof(frame), FrameValue, frame_seq, str, strlen(str), _key);
+        if (_reliable) {
+            _sender.send(frame, len, frame_seq, now);
+        } else {
+            _transmit(frame, len);
+        }
+    }
+
+    // Returns true and the acknowledged sequence number if the frame is an ack for this publisher.
+    // It's safe to call from the receive callback.
+    bool read_ack(const uint8_t *data, int len, uint32_t *seq)
+    {
+        FrameHeader header;
+        const uint8_t *payload;
+
+        if (frame_peek(data, len, &header) == false || header.type != FrameAck) { return false; }
+        if (frame_verify(data, len, _key, &payload) != sizeof(AckPayload)) { return false; }
+
+        AckPayload ack;
+        memcpy(&ack, payload, sizeof(ack));
+        *seq = ack.seq;
+        return true;
+    }
+
+    void on_ack(uint32_t seq, unsigned long now) { _sender.on_ack(seq, now); }
+    void update(unsigned long now) { if (_reliable) { _sender.update(now); } }
+};
+
+#endif
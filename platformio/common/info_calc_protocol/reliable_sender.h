@@ -0,0 +1,118 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _RELIABLE_SENDER_H_
+#define _RELIABLE_SENDER_H_
+
+#include "protocol.h"
+
+#define MIN_RTO                 20
+#define MAX_RTO                 2000
+#define INITIAL_RTO             200
+#define MAX_RETRIES             6
+
+// Keeps the latest frame until info_calc acknowledges it, and sends it again with backoff.
+// A newer frame replaces the waiting one, so that only the latest value is retried.
+class ReliableSender
+{
+public:
+    typedef bool (*Transmit)(const uint8_t *frame, size_t len);
+
+private:
+    Transmit _transmit = NULL;
+    uint8_t _frame[MAX_FRAME_LEN];
+    size_t _len = 0;
+    uint32_t _seq = 0;
+    bool _pending = false;
+    uint8_t _retries = 0;
+    unsigned long _sent_at = 0;
+    // in ms, as RFC 6298.
+    long _srtt = 0;
+    long _rttvar = 0;
+    long _rto = INITIAL_RTO;
+    uint32_t _retransmitted = 0;
+    uint32_t _given_up = 0;
+
+public:
+
+    void begin(Transmit transmit)
+    {
+        _transmit = transmit;
+    }
+
+    bool pending() { return _pending; }
+    long rto() { return _rto; }
+    uint32_t retransmitted() { return _retransmitted; }
+    uint32_t given_up() { return _given_up; }
+
+    void send(const uint8_t *frame, size_t len, uint32_t seq, unsigned long now)
+    {
+        if (len > sizeof(_frame)) { return; }
+        memcpy(_frame, frame, len);
+        _len = len;
+        _seq = seq;
+        _pending = true;
+        _retries = 0;
+        _sent_at = now;
+        _transmit(_frame, _len);
+    }
+
+    void on_ack(uint32_t seq, unsigned long now)
+    {
+        if (_pending == false || (int32_t)(seq - _seq) < 0) { return; }
+        _pending = false;
+
+        // Karn's algorithm: a retransmitted frame doesn't tell the round trip time.
+        if (_retries > 0) { return; }
+        long rtt = now - _sent_at;
+        if (_srtt == 0) {
+            _srtt = rtt;
+            _rttvar = rtt / 2;
+        } else {
+            _rttvar = (3 * _rttvar + abs(_srtt - rtt)) / 4;
+            _srtt = (7 * _srtt + rtt) / 8;
+        }
+        _rto = _srtt + max(10L, 4 * _rttvar);
+        _rto = min(max(_rto, (long)MIN_RTO), (long)MAX_RTO);
+    }
+
+    void update(unsigned long now)
+    {
+        if (_pending == false) { return; }
+        if ((long)(now - _sent_at) < (_rto << _retries)) { return; }
+
+        if (_retries >= MAX_RETRIES) {
+            _pending = false;
+            _given_up++;
+            return;
+        }
+        _retries++;
+        _retransmitted++;
+        _sent_at = now;
+        _transmit(_frame, _len);
+    }
+};
+
+#endif
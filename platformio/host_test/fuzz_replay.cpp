@@ -0,0 +1,142 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+
+// Runs a fuzz target without libFuzzer: each input of the corpus, then mutations of them
+// by a fixed seed. An input which aborts is written to crash-input, so that it can be replayed:
+//   <target> <corpus dir or file>...
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <vector>
+
+#define MUTATIONS_PER_INPUT     20000
+#define MAX_INPUT_LEN           512
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static const std::vector<uint8_t> *current_input;
+
+static void on_abort(int sig)
+{
+    FILE *file = fopen("crash-input", "wb");
+    if (file) {
+        fwrite(current_input->data(), 1, current_input->size(), file);
+        fclose(file);
+    }
+    fprintf(stderr, "The input of %zu bytes is written to crash-input.\n", current_input->size());
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// The input is in a buffer of its exact size, so the address sanitizer catches an overread.
+static void run(const std::vector<uint8_t> &input)
+{
+    current_input = &input;
+    uint8_t *data = (uint8_t *)malloc(input.size() ? input.size() : 1);
+    memcpy(data, input.data(), input.size());
+    LLVMFuzzerTestOneInput(data, input.size());
+    free(data);
+}
+
+// Flips a bit, changes, inserts or removes a byte, cuts it, or appends random bytes.
+static void mutate(std::vector<uint8_t> &data, std::mt19937 &rng)
+{
+    int changes = 1 + rng() % 3;
+    for (int i = 0; i < changes; i++) {
+        size_t at = data.empty() ? 0 : rng() % data.size();
+        switch (rng() % 6) {
+        case 0:
+            if (data.size()) { data[at] ^= 1 << (rng() % 8); }
+            break;
+        case 1:
+            if (data.size()) { data[at] = rng(); }
+            break;
+        case 2:
+            if (data.size() < MAX_INPUT_LEN) { data.insert(data.begin() + at, "0123456789,.-+ \n"[rng() % 16]); }
+            break;
+        case 3:
+            if (data.size()) { data.erase(data.begin() + at); }
+            break;
+        case 4:
+            data.resize(data.empty() ? 0 : rng() % (data.size() + 1));
+            break;
+        default:
+            for (int n = rng() % 16; n > 0 && data.size() < MAX_INPUT_LEN; n--) {
+                data.push_back(rng());
+            }
+            break;
+        }
+    }
+}
+
+static void add_input(const std::filesystem::path &path, std::vector<std::vector<uint8_t>> &inputs)
+{
+    std::ifstream file(path, std::ios::binary);
+    inputs.emplace_back(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::vector<uint8_t>> inputs;
+
+    for (int i = 1; i < argc; i++) {
+        if (std::filesystem::is_directory(argv[i])) {
+            for (const auto &entry : std::filesystem::directory_iterator(argv[i])) {
+                if (entry.is_regular_file()) { add_input(entry.path(), inputs); }
+            }
+        } else {
+            add_input(argv[i], inputs);
+        }
+    }
+    if (inputs.empty()) {
+        printf("usage: %s <corpus dir or file>...\n", argv[0]);
+        return 2;
+    }
+
+    signal(SIGABRT, on_abort);
+    std::mt19937 rng(1);
+    size_t runs = 0;
+    for (const auto &input : inputs) {
+        run(input);
+        std::vector<uint8_t> data = input;
+        for (int i = 0; i < MUTATIONS_PER_INPUT; i++) {
+            mutate(data, rng);
+            run(data);
+            // Go back to the input now and then, so that the mutations stay close to it.
+            if (rng() % 4 == 0) { data = input; }
+        }
+        runs += 1 + MUTATIONS_PER_INPUT;
+    }
+    printf("%s: %zu inputs, %zu runs, passed\n", argv[0], inputs.size(), runs);
+    return 0;
+}
@@ -0,0 +1,343 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+
+// Runs info_calc with TIME_FROM_BEACON against publishers on a lossy virtual radio.
+// The publishers send with Publisher of timer_publisher and info_calc acknowledges them,
+// so the sequence numbers, the replay window and the retransmissions are the real ones.
+// Usage: network_sim <scenario>
+
+#include <host.h>
+#include <vector>
+#include "main.cpp"
+#include <publisher.h>
+
+#define SIM_DURATION            (10 * 60 * 1000UL)
+// The publishers stop sending, and the retransmissions and the radio task finish.
+#define SIM_DRAIN               (30 * 1000UL)
+#define MAX_SIM_PUBLISHERS      20
+
+struct Scenario {
+    const char *name;
+    int publishers;
+    // in percent
+    uint8_t loss;
+    uint8_t duplicate;
+    // in ms
+    uint16_t latency;
+    uint16_t jitter;
+    // The first publisher reboots halfway.
+    bool reboot;
+};
+
+static const Scenario scenarios[] = {
+    // name, publishers, loss %, duplicate %, latency, jitter, reboot
+    { "clean", MAX_SENDERS, 0, 0, 5, 5, false },
+    { "lossy", MAX_SENDERS, 20, 0, 5, 5, false },
+    { "duplicates", MAX_SENDERS, 5, 20, 5, 5, false },
+    { "congested", MAX_SENDERS, 10, 5, 200, 800, false },
+    { "reboot", MAX_SENDERS, 5, 0, 5, 5, true },
+    // More publishers than the sender table, so they take the slots of each other.
+    { "crowded", MAX_SIM_PUBLISHERS, 5, 0, 5, 5, false },
+};
+
+struct SimPublisher {
+    int index;
+    uint8_t mac[6];
+    uint16_t ch;
+    const char *unit;
+    int32_t value;
+    uint32_t interval;
+    Publisher publisher;
+    // EEPROM of the publisher
+    uint32_t stored_limit;
+    // set by the receive side and handled by the loop, as timer_publisher does.
+    bool ack_received;
+    uint32_t acked_seq;
+    unsigned long acked_at;
+    // value frames which reached info_calc
+    bool delivered;
+    uint32_t highest_delivered;
+    unsigned long highest_delivered_at;
+};
+
+struct Flight {
+    uint64_t at;
+    int publisher;
+    bool to_display;
+    std::vector<uint8_t> data;
+};
+
+struct LinkStats {
+    uint32_t sent;
+    uint32_t lost;
+    uint32_t duplicated;
+    uint32_t delivered;
+};
+
+// Every publisher has its own MAC address.
+static const uint8_t sim_mac_prefix[] = { 0x02, 0x51, 0x4d, 0x00, 0x00 };
+static const Scenario *scenario;
+static SimPublisher sim_publishers[MAX_SIM_PUBLISHERS];
+// the publisher whose code runs now, for the callbacks without a context.
+static SimPublisher *sending = NULL;
+static bool sim_running = true;
+static std::vector<Flight> air;
+static LinkStats link_stats;
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            failures++; \
+            printf("FAIL %s: ", scenario->name); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+        } \
+    } while (0)
+
+static void launch(int publisher, bool to_display, const uint8_t *data, size_t len)
+{
+    link_stats.sent++;
+    if (random(100) < scenario->loss) {
+        link_stats.lost++;
+        return;
+    }
+    int copies = random(100) < scenario->duplicate ? 2 : 1;
+    link_stats.duplicated += copies - 1;
+    for (int i = 0; i < copies; i++) {
+        Flight flight;
+        flight.at = host_now_us() + (scenario->latency + random(scenario->jitter + 1)) * 1000ULL;
+        flight.publisher = publisher;
+        flight.to_display = to_display;
+        flight.data.assign(data, data + len);
+        air.push_back(flight);
+    }
+}
+
+static bool sim_transmit(const uint8_t *frame, size_t len)
+{
+    launch(sending->index, true, frame, len);
+    return true;
+}
+
+static void sim_store_limit(uint32_t limit)
+{
+    sending->stored_limit = limit;
+}
+
+// Acks from info_calc
+static void on_display_send(const uint8_t *mac_addr, const uint8_t *data, size_t len)
+{
+    for (int i = 0; i < scenario->publishers; i++) {
+        if (memcmp(sim_publishers[i].mac, mac_addr, 6) == 0) {
+            launch(i, false, data, len);
+            return;
+        }
+    }
+}
+
+static void deliver(const Flight *flight)
+{
+    SimPublisher *p = &sim_publishers[flight->publisher];
+    link_stats.delivered++;
+
+    if (flight->to_display) {
+        FrameHeader header;
+        if (frame_peek(flight->data.data(), flight->data.size(), &header) && header.type == FrameValue &&
+            (p->delivered == false || (int32_t)(header.seq - p->highest_delivered) > 0)) {
+            p->delivered = true;
+            p->highest_delivered = header.seq;
+            p->highest_delivered_at = millis();
+        }
+        host_receive(p->mac, flight->data.data(), flight->data.size());
+        return;
+    }
+
+    uint32_t seq;
+    if (p->publisher.read_ack(flight->data.data(), flight->data.size(), &seq)) {
+        p->acked_seq = seq;
+        p->acked_at = millis();
+        p->ack_received = true;
+    }
+}
+
+// A frame with a longer latency can arrive after a later frame.
+static void link_task(void *param)
+{
+    while (true) {
+        uint64_t now = host_now_us();
+        for (size_t i = 0; i < air.size();) {
+            if (air[i].at > now) {
+                i++;
+                continue;
+            }
+            Flight flight = air[i];
+            air.erase(air.begin() + i);
+            deliver(&flight);
+        }
+        delay(1);
+    }
+}
+
+// The loop of timer_publisher with RELIABLE_ESPNOW, sending a value every interval.
+static void publisher_task(void *param)
+{
+    SimPublisher *p = (SimPublisher *)param;
+
+    // Spread the first frames over the interval.
+    delay(random(p->interval));
+    unsigned long sent_at = millis() - p->interval;
+    while (true) {
+        unsigned long now = millis();
+        sending = p;
+        if (sim_running && now - sent_at >= p->interval) {
+            sent_at = now;
+            p->value += random(-10, 11);
+            p->publisher.send_value(p->ch, p->value, p->unit, now);
+        }
+        if (p->ack_received) {
+            p->ack_received = false;
+            p->publisher.on_ack(p->acked_seq, p->acked_at);
+        }
+        p->publisher.update(millis());
+        sending = NULL;
+        delay(10);
+    }
+}
+
+static void begin_publisher(SimPublisher *p)
+{
+    p->publisher = Publisher();
+    p->publisher.begin(frame_open_key, p->stored_limit, sim_store_limit, sim_transmit, true);
+    p->ack_received = false;
+}
+
+static void check_results(uint32_t rebooted_limit)
+{
+    bool crowded = scenario->publishers > MAX_SENDERS;
+
+    CHECK(rejected_frames == 0, "%u frames rejected", rejected_frames);
+    CHECK(junk_frames == 0, "%u junk frames", junk_frames);
+    CHECK(crowded || dropped_frames == 0, "%u frames dropped by the radio queue", dropped_frames);
+
+    for (int i = 0; i < scenario->publishers; i++) {
+        SimPublisher *p = &sim_publishers[i];
+        ReliableSender *sender = p->publisher.sender();
+        ChannelValue *value = channels.get(p->ch);
+
+        CHECK(p->delivered, "ch %d: nothing delivered", p->ch);
+        CHECK(channels.available(p->ch), "ch %d: not available", p->ch);
+        CHECK(strcmp(value->unit, p->unit) == 0, "ch %d: unit %s, not %s", p->ch, value->unit, p->unit);
+        CHECK(sender->pending() == false, "ch %d: a frame is still waiting for the ack", p->ch);
+        if (scenario->loss == 0) {
+            CHECK(sender->retransmitted() == 0 && sender->given_up() == 0,
+                "ch %d: %u retransmitted, %u given up on a clean link", p->ch, sender->retransmitted(),
+                sender->given_up());
+        }
+        if (crowded) { continue; }
+
+        // The slot is never taken by another one.
+        Sender *peer = senders.find(p->mac);
+        CHECK(peer != NULL, "ch %d: no sender slot", p->ch);
+        if (peer == NULL) { continue; }
+        CHECK(peer->window.highest() == p->highest_delivered, "ch %d: highest seq %u, %u delivered", p->ch,
+            peer->window.highest(), p->highest_delivered);
+        CHECK(value->received_at >= p->highest_delivered_at, "ch %d: received at %lu, delivered at %lu",
+            p->ch, value->received_at, p->highest_delivered_at);
+        if (scenario->loss == 0) {
+            CHECK(value->lost == 0, "ch %d: %u lost on a clean link", p->ch, value->lost);
+        }
+        if (i == 0 && scenario->reboot) {
+            // A reboot starts at the stored limit, above any seq of the last boot.
+            CHECK((int32_t)(peer->window.highest() - rebooted_limit) >= 0,
+                "ch %d: highest seq %u after the reboot, below the limit %u", p->ch, peer->window.highest(),
+                rebooted_limit);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const int number_of_scenarios = sizeof(scenarios) / sizeof(scenarios[0]);
+
+    for (int i = 0; i < number_of_scenarios && argc > 1; i++) {
+        if (strcmp(argv[1], scenarios[i].name) == 0) {
+            scenario = &scenarios[i];
+        }
+    }
+    if (scenario == NULL) {
+        printf("usage: %s <scenario>\n", argv[0]);
+        return 2;
+    }
+
+    randomSeed(scenario - scenarios + 1);
+    host_on_send(on_display_send);
+    host_start(setup, loop);
+    host_run_for(1000);
+
+    host_create_task(link_task, NULL, "link");
+    for (int i = 0; i < scenario->publishers; i++) {
+        SimPublisher *p = &sim_publishers[i];
+        p->index = i;
+        memcpy(p->mac, sim_mac_prefix, sizeof(sim_mac_prefix));
+        p->mac[5] = i;
+        // temperatures and humidities at 2 to 21 seconds
+        p->ch = i + 1;
+        p->unit = i % 2 ? "%" : "°C";
+        p->value = i % 2 ? 4000 + i * 100 : 2000 + i * 50;
+        p->interval = (2 + i) * 1000;
+        // The flash is erased.
+        p->stored_limit = 0xFFFFFFFF;
+        begin_publisher(p);
+        host_create_task(publisher_task, p, "publisher");
+    }
+
+    uint32_t rebooted_limit = 0;
+    if (scenario->reboot) {
+        host_run_for(SIM_DURATION / 2);
+        SimPublisher *p = &sim_publishers[0];
+        rebooted_limit = p->stored_limit;
+        begin_publisher(p);
+        host_run_for(SIM_DURATION / 2);
+    } else {
+        host_run_for(SIM_DURATION);
+    }
+    sim_running = false;
+    host_run_for(SIM_DRAIN);
+
+    uint32_t retransmitted = 0;
+    uint32_t given_up = 0;
+    for (int i = 0; i < scenario->publishers; i++) {
+        retransmitted += sim_publishers[i].publisher.sender()->retransmitted();
+        given_up += sim_publishers[i].publisher.sender()->given_up();
+    }
+    printf("%s: sent %u, lost %u, duplicated %u, delivered %u, retransmitted %u, given up %u, "
+        "dropped %u, presses %u\n", scenario->name, link_stats.sent, link_stats.lost, link_stats.duplicated,
+        link_stats.delivered, retransmitted, given_up, dropped_frames, displays[0].actuator().pressed_count());
+
+    check_results(rebooted_limit);
+    printf("%s: %s\n", scenario->name, failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,130 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+
+// A fuzz target of the receive path before the channel table: the frame checks,
+// the value payload parser and the control frames applied to ConfigStore.
+// Each input is received as it is, and sealed with the open key as a payload of the type in its
+// first byte, so that mutated payloads get past the tag too. It aborts on a broken invariant.
+// clang builds it with libFuzzer; the other compilers with fuzz_replay.cpp.
+
+#include <Arduino.h>
+#include <ESP32Servo.h>
+#include <protocol.h>
+#include "config_store.h"
+
+static ConfigStore config_store;
+
+static void receive_value(const uint8_t *payload, int len)
+{
+    ValuePayload parsed;
+
+    if (parse_value_payload(payload, len, &parsed) == false) { return; }
+    if (strlen(parsed.unit) > MAX_UNIT_LEN) { abort(); }
+}
+
+static void receive_control(const uint8_t *payload, int len)
+{
+    static RuntimeConfig defaults;
+    ControlHeader header;
+
+    int count = control_item_count(payload, len, &header);
+    if (count < 0) { return; }
+    if (count > MAX_CONTROL_ITEMS || len != (int)(sizeof(header) + count * sizeof(ControlItem))) { abort(); }
+
+    // Every input starts from the same config, so a crash replays from its input alone.
+    init_channel_policies();
+    defaults.revision = 1;
+    defaults.rounding_interval = MIN_ROUNDING_INTERVAL;
+    defaults.invalid_data_interval = MIN_INVALID_INTERVAL;
+    defaults.brightness = 1;
+    defaults.max_speed = defaults.max_accel = defaults.hold_time = 0;
+    memcpy(defaults.policies, channel_policies, sizeof(defaults.policies));
+    config_store.begin(&defaults);
+
+    RuntimeConfig before = *config_store.config();
+    ControlReply reply = config_store.apply(&header, (const ControlItem *)(payload + sizeof(header)));
+    switch (reply.status) {
+    case ControlApplied:
+        // Only a frame which names the active revision is applied, so a replayed one is stale.
+        if (header.base_revision != before.revision) { abort(); }
+        if (config_store.revision() != before.revision + 1 || reply.revision != config_store.revision()) { abort(); }
+        break;
+    case ControlStale:
+    case ControlInvalid:
+        // None of the items is applied.
+        if (memcmp(config_store.config(), &before, sizeof(before)) != 0) { abort(); }
+        if (reply.status == ControlInvalid && reply.item >= count) { abort(); }
+        break;
+    default:
+        abort();
+    }
+}
+
+// as accept_frame() and the radio task of info_calc with the open key
+static void receive(const uint8_t *data, int len)
+{
+    FrameHeader header;
+    const uint8_t *payload;
+
+    if (len <= 0) { return; }
+    if (data[0] != FRAME_MAGIC) {
+        // a text frame from an old publisher
+        receive_value(data, len);
+        return;
+    }
+    if (frame_peek(data, len, &header) == false) { return; }
+    int payload_len = frame_verify(data, len, frame_open_key, &payload);
+    if (payload_len < 0) { return; }
+    if (payload != data + sizeof(FrameHeader) || payload_len != len - (int)(sizeof(FrameHeader) + FRAME_TAG_LEN)) {
+        abort();
+    }
+
+    switch (header.type) {
+    case FrameValue:
+        receive_value(payload, payload_len);
+        break;
+    case FrameControl:
+        receive_control(payload, payload_len);
+        break;
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size > MAX_FRAME_LEN) { return 0; }
+    receive(data, size);
+    if (size == 0) { return 0; }
+
+    // The sealed frame is in a buffer of its exact size, so the address sanitizer catches an overread.
+    uint8_t sealed[MAX_FRAME_LEN];
+    size_t len = frame_seal(sealed, sizeof(sealed), data[0], size, data + 1, size - 1, frame_open_key);
+    if (len == 0) { return 0; }
+    uint8_t *frame = (uint8_t *)malloc(len);
+    memcpy(frame, sealed, len);
+    receive(frame, len);
+    free(frame);
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+
+// Walks random transitions of Planner::set_value() on CalculatorEmulator and checks that
+// the calculator shows the target within max_walk_presses(). Any mismatch fails the run.
+//   set_value_fuzz <digits> [seed] [transitions]
+
+#include <Arduino.h>
+#include <ESP32Servo.h>
+#include "planner.h"
+#include "calc_emulator.h"
+
+#define DEFAULT_SEED            1
+#define DEFAULT_TRANSITIONS     100000
+#define MAX_REPORTED_FAILURES   10
+
+static void on_key(Key key, void *context)
+{
+    ((CalculatorEmulator *)context)->press(key);
+}
+
+// Targets which are likely to break the walk: random ones, close ones,
+// and ones made of 0, 4, 5, 6 and 9 which fold and carry.
+static int fuzz_target(int from, int places, int range)
+{
+    int v = 0;
+    switch (random(4)) {
+    case 0:
+        v = random(-range, range + 1);
+        break;
+    case 1:
+        v = from + random(-200, 201);
+        break;
+    case 2:
+        {
+            static const int pick[] = { 0, 4, 5, 6, 9 };
+            for (int i = random(1, places + 1); i > 0; i--) {
+                v = v * 10 + pick[random(5)];
+            }
+            if (random(2)) { v = -v; }
+        }
+        break;
+    default:
+        v = random(2) ? range : -range;
+        break;
+    }
+    return constrain(v, -range, range);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        printf("usage: %s <digits> [seed] [transitions]\n", argv[0]);
+        return 2;
+    }
+    KeyMap keymap = default_keymap;
+    keymap.digits = atoi(argv[1]);
+    unsigned long seed = argc > 2 ? strtoul(argv[2], NULL, 0) : DEFAULT_SEED;
+    int transitions = argc > 3 ? atoi(argv[3]) : DEFAULT_TRANSITIONS;
+    const char *error = keymap.validate();
+    if (error) {
+        printf("set_value_fuzz: %s\n", error);
+        return 2;
+    }
+    keymap.update_press_times();
+
+    CalculatorEmulator emulator;
+    Planner planner;
+    uint32_t failures = 0;
+    uint32_t max_presses = 0;
+    uint64_t total_presses = 0;
+
+    randomSeed(seed);
+    planner.begin(&keymap, NULL);
+    planner.set_listener(on_key, &emulator);
+    emulator.begin(keymap.digits);
+    planner.clear_all();
+    int places = planner.walk_places();
+    int range = planner.max_value();
+    uint32_t bound = max_walk_presses(places);
+
+    for (int i = 0; i < transitions; i++) {
+        int from = planner.value();
+        int to = fuzz_target(from, places, range);
+        uint32_t before = planner.presses();
+        planner.set_value(to);
+        uint32_t presses = planner.presses() - before;
+        max_presses = max(max_presses, presses);
+        total_presses += presses;
+
+        bool passed = emulator.error() == false && emulator.display() == to &&
+                      planner.value() == to && presses <= bound;
+        if (passed) { continue; }
+
+        if (++failures <= MAX_REPORTED_FAILURES) {
+            printf("FAIL #%d %d -> %d: shows %lld%s, planned %d, %u presses\n",
+                i, from, to, (long long)emulator.display(), emulator.error() ? " (E)" : "", planner.value(), presses);
+        }
+        // Start again from a known state.
+        emulator.begin(keymap.digits);
+        planner.clear_all();
+    }
+
+    printf("set_value_fuzz: %d digits, seed %lu, %d places -%d to %d, presses avg %.1f max %u (bound %u), %u failures, %s\n",
+        keymap.digits, seed, places, range, range, (double)total_presses / max(transitions, 1), max_presses, bound,
+        failures, failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,127 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+
+// The Arduino core for the host build. The clock, the tasks and the queues are in host.cpp.
+
+#ifndef _HOST_ARDUINO_H_
+#define _HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+#define HIGH                    1
+#define LOW                     0
+#define INPUT                   0
+#define OUTPUT                  1
+#define PRO_CPU_NUM             0
+#define APP_CPU_NUM             1
+#define IRAM_ATTR
+#define constrain(x, low, high) ((x) < (low) ? (low) : ((x) > (high) ? (high) : (x)))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+uint32_t analogReadMilliVolts(int pin);
+long random(long high);
+long random(long low, long high);
+void randomSeed(unsigned long seed);
+
+class HostSerial
+{
+public:
+    void begin(int baud) {}
+    void print(const char *s);
+    void println(const char *s = "");
+    void println(const struct tm *info, const char *format);
+    int printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+extern HostSerial Serial;
+
+class HostEsp
+{
+public:
+    void restart();
+    uint32_t getFreeHeap() { return 0; }
+    uint32_t getMinFreeHeap() { return 0; }
+};
+extern HostEsp ESP;
+
+bool getLocalTime(struct tm *info, uint32_t ms = 5000);
+void configTime(long gmt_offset, int daylight_offset, const char *server1,
+                const char *server2 = NULL, const char *server3 = NULL);
+
+// FreeRTOS
+typedef void *TaskHandle_t;
+typedef void *QueueHandle_t;
+typedef void *SemaphoreHandle_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef int portMUX_TYPE;
+
+#define pdTRUE                  1
+#define pdFALSE                 0
+#define pdPASS                  1
+#define portMAX_DELAY           0xffffffffUL
+#define portTICK_PERIOD_MS      1
+#define pdMS_TO_TICKS(ms)       (ms)
+#define portMUX_INITIALIZER_UNLOCKED 0
+
+// The tasks take turns, so a critical section needs no lock.
+#define portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL(mux)
+#define portENTER_CRITICAL_ISR(mux)
+#define portEXIT_CRITICAL_ISR(mux)
+
+BaseType_t xTaskCreatePinnedToCore(void (*task)(void *), const char *name, uint32_t stack, void *param,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+void vTaskDelay(TickType_t ticks);
+void vTaskDelayUntil(TickType_t *woke_at, TickType_t ticks);
+TickType_t xTaskGetTickCount();
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t wait);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+SemaphoreHandle_t xSemaphoreCreateMutex();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex);
+
+#endif
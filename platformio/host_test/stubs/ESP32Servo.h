@@ -0,0 +1,75 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+
+// Servos for the host build.
+
+#ifndef _HOST_ESP32_SERVO_H_
+#define _HOST_ESP32_SERVO_H_
+
+// host.cpp hands the pulses to the hook of the test.
+void host_servo_write(int pin, int us);
+
+// A servo which tells the pulse width to the host.
+class Servo
+{
+private:
+    int _pin = -1;
+    int _min_us = 544;
+    int _max_us = 2400;
+
+public:
+    void setPeriodHertz(int hz) {}
+
+    int attach(int pin, int min_us, int max_us)
+    {
+        _pin = pin;
+        _min_us = min_us;
+        _max_us = max_us;
+        return 0;
+    }
+
+    // Values below the shortest pulse are angles, as ESP32Servo does.
+    void write(int value)
+    {
+        if (value < _min_us) {
+            value = _min_us + (value < 0 ? 0 : value > 180 ? 180 : value) * (_max_us - _min_us) / 180;
+        }
+        writeMicroseconds(value);
+    }
+
+    void writeMicroseconds(int us)
+    {
+        if (_pin >= 0) { host_servo_write(_pin, us); }
+    }
+};
+
+class ESP32PWM
+{
+public:
+    static void allocateTimer(int timer) {}
+};
+
+#endif
@@ -0,0 +1,71 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+
+// The LED matrix for the host build. It counts the shows only.
+
+#ifndef _HOST_FASTLED_H_
+#define _HOST_FASTLED_H_
+
+#include <stdint.h>
+
+struct CRGB {
+    uint8_t r = 0;
+    uint8_t g = 0;
+    uint8_t b = 0;
+
+    enum {
+        Black = 0x000000, Red = 0xff0000, Green = 0x00ff00, Blue = 0x0000ff,
+        White = 0xffffff, Yellow = 0xffff00, Orange = 0xffa500, Purple = 0x800080,
+    };
+
+    CRGB() {}
+    CRGB(uint32_t c) : r(c >> 16), g(c >> 8), b(c) {}
+    CRGB(uint8_t red, uint8_t green, uint8_t blue) : r(red), g(green), b(blue) {}
+    bool operator==(const CRGB &o) const { return r == o.r && g == o.g && b == o.b; }
+    bool operator!=(const CRGB &o) const { return !(*this == o); }
+    CRGB &nscale8(uint8_t scale)
+    {
+        r = r * scale / 256;
+        g = g * scale / 256;
+        b = b * scale / 256;
+        return *this;
+    }
+};
+
+#define NEOPIXEL                1
+
+class HostFastLED
+{
+public:
+    uint32_t shows = 0;
+
+    template <int TYPE, int PIN> void addLeds(CRGB *leds, int count) {}
+    void setBrightness(int brightness) {}
+    void show() { shows++; }
+};
+extern HostFastLED FastLED;
+
+#endif
@@ -0,0 +1,100 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+
+// M5Unified for the host build. Button A follows host_press_button(), and button B is never pressed.
+
+#ifndef _HOST_M5UNIFIED_H_
+#define _HOST_M5UNIFIED_H_
+
+#include <Arduino.h>
+
+class HostButton
+{
+public:
+    // set by M5.update()
+    bool pressed = false;
+    bool was_pressed = false;
+    bool was_released = false;
+    unsigned long held = 0;
+
+    bool isPressed() { return pressed; }
+    bool wasPressed() { return was_pressed; }
+    bool wasReleased() { return was_released; }
+    bool wasReleaseFor(unsigned long ms) { return was_released && held >= ms; }
+};
+
+class HostLcd
+{
+public:
+    void clear() {}
+    void setColor(int color) {}
+    void setCursor(int x, int y) {}
+    void setTextSize(int size) {}
+    void setRotation(int rotation) {}
+    void print(const char *s) {}
+    void println(const char *s = "") {}
+    int printf(const char *format, ...) { return 0; }
+};
+
+struct rtc_datetime_t {
+    struct tm info;
+    struct tm get_tm() const { return info; }
+};
+
+class HostRtc
+{
+public:
+    rtc_datetime_t getDateTime() { return rtc_datetime_t(); }
+    void setDateTime(const struct tm *info) {}
+};
+
+class HostPower
+{
+public:
+    void powerOff() {}
+};
+
+struct HostM5Config {};
+
+class HostM5
+{
+public:
+    HostButton BtnA;
+    HostButton BtnB;
+    HostLcd Lcd;
+    HostRtc Rtc;
+    HostPower Power;
+
+    HostM5Config config() { return HostM5Config(); }
+    void begin(HostM5Config config) {}
+    void update();
+};
+extern HostM5 M5;
+
+static const int GREEN = 0x07e0;
+static const int RED = 0xf800;
+
+#endif
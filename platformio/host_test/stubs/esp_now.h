@@ -0,0 +1,73 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+
+// ESP-NOW for the host build. A test takes the sent frames with host_on_send().
+
+#ifndef _HOST_ESP_NOW_H_
+#define _HOST_ESP_NOW_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK                  0
+#define ESP_ERR_ESPNOW_NOT_INIT 0x3065
+#define ESP_ERR_ESPNOW_ARG      0x3066
+#define ESP_ERR_ESPNOW_NO_MEM   0x3067
+#define ESP_ERR_ESPNOW_FULL     0x3068
+#define ESP_ERR_ESPNOW_NOT_FOUND 0x3069
+#define ESP_ERR_ESPNOW_INTERNAL 0x306a
+#define ESP_ERR_ESPNOW_EXIST    0x306b
+#define ESP_NOW_ETH_ALEN        6
+#define ESP_NOW_KEY_LEN         16
+#define ESP_NOW_MAX_DATA_LEN    250
+
+typedef enum { ESP_NOW_SEND_SUCCESS, ESP_NOW_SEND_FAIL } esp_now_send_status_t;
+typedef enum { WIFI_IF_STA } wifi_interface_t;
+
+typedef struct {
+    uint8_t peer_addr[ESP_NOW_ETH_ALEN];
+    uint8_t lmk[ESP_NOW_KEY_LEN];
+    uint8_t channel;
+    wifi_interface_t ifidx;
+    bool encrypt;
+    void *priv;
+} esp_now_peer_info_t;
+
+typedef void (*esp_now_recv_cb_t)(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+typedef void (*esp_now_send_cb_t)(const uint8_t *mac_addr, esp_now_send_status_t status);
+
+esp_err_t esp_now_init();
+esp_err_t esp_now_set_pmk(const uint8_t *pmk);
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer);
+esp_err_t esp_now_del_peer(const uint8_t *mac_addr);
+bool esp_now_is_peer_exist(const uint8_t *mac_addr);
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb);
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb);
+esp_err_t esp_now_send(const uint8_t *mac_addr, const uint8_t *data, size_t len);
+
+#endif
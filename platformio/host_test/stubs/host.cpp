@@ -0,0 +1,446 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+
+#include <stdarg.h>
+#include <setjmp.h>
+#include <ucontext.h>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "host.h"
+#include <FastLED.h>
+#include <M5Unified.h>
+#include <Preferences.h>
+#include <WiFi.h>
+#include <esp_timer.h>
+
+#define HOST_TASK_STACK         (256 * 1024)
+#define HOST_FOREVER            UINT64_MAX
+
+struct HostTask {
+    const char *name;
+    void (*run)(void *);
+    void *param;
+    ucontext_t start;
+    jmp_buf resume;
+    bool started;
+    bool done;
+    uint64_t wake_at;
+    // the turn it ran last, so that the tasks waking at the same time take turns.
+    uint64_t turn;
+    // the queue it waits for, or NULL.
+    void *queue;
+    std::vector<char> stack;
+};
+
+struct HostQueue {
+    size_t item_size;
+    size_t length;
+    std::vector<std::vector<uint8_t>> items;
+};
+
+struct HostMutex {
+    HostTask *owner;
+};
+
+static uint64_t now_us = 0;
+static uint64_t turns = 0;
+static std::vector<HostTask *> tasks;
+static HostTask *current = NULL;
+static jmp_buf scheduler;
+static HostSendHook send_hook = NULL;
+static HostServoHook servo_hook = NULL;
+static esp_now_recv_cb_t recv_cb = NULL;
+static std::vector<std::vector<uint8_t>> peers;
+static std::map<std::string, std::vector<uint8_t>> nvs;
+static std::mt19937 rng(1);
+
+struct ButtonPress {
+    unsigned long at;
+    unsigned long hold;
+};
+static std::vector<ButtonPress> button_script;
+static size_t next_press = 0;
+static unsigned long pressed_at = 0;
+
+HostSerial Serial;
+HostEsp ESP;
+HostFastLED FastLED;
+HostM5 M5;
+HostWiFi WiFi;
+
+// scheduler
+
+static void task_entry()
+{
+    current->run(current->param);
+    current->done = true;
+    _longjmp(scheduler, 1);
+}
+
+// Gives the turn to the other tasks until the clock reaches wake_at.
+static void wait_until(uint64_t wake_at)
+{
+    if (current == NULL) {
+        // called by the test, not by a task
+        if (wake_at != HOST_FOREVER && wake_at > now_us) { now_us = wake_at; }
+        return;
+    }
+    current->wake_at = wake_at;
+    if (_setjmp(current->resume) == 0) {
+        _longjmp(scheduler, 1);
+    }
+}
+
+static HostTask *next_task()
+{
+    HostTask *next = NULL;
+    for (HostTask *task : tasks) {
+        if (task->done) { continue; }
+        if (next == NULL || task->wake_at < next->wake_at ||
+            (task->wake_at == next->wake_at && task->turn < next->turn)) {
+            next = task;
+        }
+    }
+    return next;
+}
+
+void host_create_task(void (*run)(void *), void *param, const char *name)
+{
+    HostTask *task = new HostTask();
+    task->name = name;
+    task->run = run;
+    task->param = param;
+    task->wake_at = now_us;
+    task->stack.resize(HOST_TASK_STACK);
+    getcontext(&task->start);
+    task->start.uc_stack.ss_sp = task->stack.data();
+    task->start.uc_stack.ss_size = task->stack.size();
+    task->start.uc_link = NULL;
+    makecontext(&task->start, task_entry, 0);
+    tasks.push_back(task);
+}
+
+struct Sketch {
+    void (*setup)();
+    void (*loop)();
+};
+
+static void loop_task(void *param)
+{
+    Sketch *sketch = (Sketch *)param;
+    sketch->setup();
+    while (true) {
+        sketch->loop();
+        // Arduino yields between the loops.
+        wait_until(now_us);
+    }
+}
+
+void host_start(void (*setup)(), void (*loop)())
+{
+    static Sketch sketch;
+    sketch.setup = setup;
+    sketch.loop = loop;
+    host_create_task(loop_task, &sketch, "loopTask");
+}
+
+void host_run_for(unsigned long ms)
+{
+    uint64_t end = now_us + ms * 1000ULL;
+
+    while (true) {
+        HostTask *task = next_task();
+        if (task == NULL || task->wake_at > end) { break; }
+        if (task->wake_at > now_us) { now_us = task->wake_at; }
+        task->turn = ++turns;
+        current = task;
+        if (_setjmp(scheduler) == 0) {
+            if (task->started) {
+                _longjmp(task->resume, 1);
+            }
+            task->started = true;
+            setcontext(&task->start);
+        }
+        current = NULL;
+    }
+    now_us = end;
+}
+
+uint64_t host_now_us() { return now_us; }
+
+// Arduino
+
+unsigned long millis() { return now_us / 1000; }
+unsigned long micros() { return now_us; }
+void delay(unsigned long ms) { wait_until(now_us + ms * 1000ULL); }
+void delayMicroseconds(unsigned int us) { wait_until(now_us + us); }
+void pinMode(int pin, int mode) {}
+void digitalWrite(int pin, int value) {}
+uint32_t analogReadMilliVolts(int pin) { return 0; }
+long random(long high) { return high > 0 ? rng() % high : 0; }
+long random(long low, long high) { return high > low ? low + (long)(rng() % (high - low)) : low; }
+void randomSeed(unsigned long seed) { rng.seed(seed); }
+int64_t esp_timer_get_time() { return now_us; }
+
+bool host_serial_enabled()
+{
+    static int enabled = -1;
+    if (enabled < 0) { enabled = getenv("HOST_SERIAL") != NULL; }
+    return enabled;
+}
+
+void HostSerial::print(const char *s)
+{
+    if (host_serial_enabled()) { fputs(s, stdout); }
+}
+
+void HostSerial::println(const char *s)
+{
+    if (host_serial_enabled()) { puts(s); }
+}
+
+void HostSerial::println(const struct tm *info, const char *format)
+{
+    char buf[64];
+    strftime(buf, sizeof(buf), format, info);
+    println(buf);
+}
+
+int HostSerial::printf(const char *format, ...)
+{
+    if (host_serial_enabled() == false) { return 0; }
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+    return n;
+}
+
+void HostEsp::restart()
+{
+    fprintf(stderr, "ESP.restart() at %llu ms\n", (unsigned long long)(now_us / 1000));
+    exit(1);
+}
+
+bool getLocalTime(struct tm *info, uint32_t ms) { return false; }
+void configTime(long gmt_offset, int daylight_offset, const char *server1, const char *server2, const char *server3) {}
+
+void host_press_button(unsigned long at_ms, unsigned long hold_ms)
+{
+    button_script.push_back({ at_ms, hold_ms });
+}
+
+// Button A follows the script, as M5.update() polls the button.
+void HostM5::update()
+{
+    unsigned long now = millis();
+
+    BtnA.was_pressed = false;
+    BtnA.was_released = false;
+    if (next_press >= button_script.size()) { return; }
+
+    const ButtonPress *press = &button_script[next_press];
+    if (BtnA.pressed == false) {
+        if (now >= press->at) {
+            BtnA.pressed = true;
+            BtnA.was_pressed = true;
+            pressed_at = now;
+        }
+    } else
+    if (now - pressed_at >= press->hold) {
+        BtnA.pressed = false;
+        BtnA.was_released = true;
+        BtnA.held = now - pressed_at;
+        next_press++;
+    }
+}
+
+void host_on_servo(HostServoHook hook) { servo_hook = hook; }
+
+void host_servo_write(int pin, int us)
+{
+    if (servo_hook) { servo_hook(pin, us); }
+}
+
+bool Preferences::begin(const char *name, bool read_only)
+{
+    _name = name;
+    return true;
+}
+
+size_t Preferences::getBytesLength(const char *key)
+{
+    auto it = nvs.find(std::string(_name) + "/" + key);
+    return it == nvs.end() ? 0 : it->second.size();
+}
+
+size_t Preferences::getBytes(const char *key, void *buf, size_t len)
+{
+    auto it = nvs.find(std::string(_name) + "/" + key);
+    if (it == nvs.end() || it->second.size() > len) { return 0; }
+    memcpy(buf, it->second.data(), it->second.size());
+    return it->second.size();
+}
+
+size_t Preferences::putBytes(const char *key, const void *buf, size_t len)
+{
+    nvs[std::string(_name) + "/" + key].assign((const uint8_t *)buf, (const uint8_t *)buf + len);
+    return len;
+}
+
+// FreeRTOS
+
+BaseType_t xTaskCreatePinnedToCore(void (*task)(void *), const char *name, uint32_t stack, void *param,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+    host_create_task(task, param, name);
+    if (handle) { *handle = tasks.back(); }
+    return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() { return current; }
+void vTaskDelay(TickType_t ticks) { wait_until(now_us + ticks * 1000ULL); }
+TickType_t xTaskGetTickCount() { return now_us / 1000; }
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) { return 0; }
+
+void vTaskDelayUntil(TickType_t *woke_at, TickType_t ticks)
+{
+    *woke_at += ticks;
+    wait_until(max((uint64_t)*woke_at * 1000, now_us));
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    HostQueue *queue = new HostQueue();
+    queue->item_size = item_size;
+    queue->length = length;
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t handle, const void *item, TickType_t wait)
+{
+    HostQueue *queue = (HostQueue *)handle;
+    if (queue->items.size() >= queue->length) { return pdFALSE; }
+    queue->items.emplace_back((const uint8_t *)item, (const uint8_t *)item + queue->item_size);
+    for (HostTask *task : tasks) {
+        if (task->queue == queue) {
+            task->queue = NULL;
+            task->wake_at = now_us;
+        }
+    }
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t handle, void *item, TickType_t wait)
+{
+    HostQueue *queue = (HostQueue *)handle;
+    uint64_t timeout = wait == portMAX_DELAY ? HOST_FOREVER : now_us + wait * 1000ULL;
+
+    while (queue->items.empty()) {
+        if (now_us >= timeout || current == NULL) { return pdFALSE; }
+        current->queue = queue;
+        wait_until(timeout);
+        current->queue = NULL;
+    }
+    memcpy(item, queue->items.front().data(), queue->item_size);
+    queue->items.erase(queue->items.begin());
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t handle) { return ((HostQueue *)handle)->items.size(); }
+
+SemaphoreHandle_t xSemaphoreCreateMutex() { return new HostMutex(); }
+
+// The tasks switch only when they wait, so a mutex is taken by another task
+// only while it waits with the mutex. Check it again every tick.
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t wait)
+{
+    HostMutex *mutex = (HostMutex *)handle;
+    uint64_t timeout = wait == portMAX_DELAY ? HOST_FOREVER : now_us + wait * 1000ULL;
+
+    while (mutex->owner && mutex->owner != current) {
+        if (now_us >= timeout) { return pdFALSE; }
+        wait_until(now_us + 1000);
+    }
+    mutex->owner = current;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle)
+{
+    ((HostMutex *)handle)->owner = NULL;
+    return pdTRUE;
+}
+
+// ESP-NOW
+
+void host_on_send(HostSendHook hook) { send_hook = hook; }
+
+void host_receive(const uint8_t *mac_addr, const uint8_t *data, int len)
+{
+    if (recv_cb) { recv_cb(mac_addr, data, len); }
+}
+
+esp_err_t esp_now_init() { return ESP_OK; }
+esp_err_t esp_now_set_pmk(const uint8_t *pmk) { return ESP_OK; }
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb) { recv_cb = cb; return ESP_OK; }
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb) { return ESP_OK; }
+
+bool esp_now_is_peer_exist(const uint8_t *mac_addr)
+{
+    for (const std::vector<uint8_t> &peer : peers) {
+        if (memcmp(peer.data(), mac_addr, ESP_NOW_ETH_ALEN) == 0) { return true; }
+    }
+    return false;
+}
+
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer)
+{
+    if (esp_now_is_peer_exist(peer->peer_addr)) { return ESP_ERR_ESPNOW_EXIST; }
+    peers.emplace_back(peer->peer_addr, peer->peer_addr + ESP_NOW_ETH_ALEN);
+    return ESP_OK;
+}
+
+esp_err_t esp_now_del_peer(const uint8_t *mac_addr)
+{
+    for (size_t i = 0; i < peers.size(); i++) {
+        if (memcmp(peers[i].data(), mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            peers.erase(peers.begin() + i);
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_ESPNOW_NOT_FOUND;
+}
+
+esp_err_t esp_now_send(const uint8_t *mac_addr, const uint8_t *data, size_t len)
+{
+    if (len > ESP_NOW_MAX_DATA_LEN) { return ESP_ERR_ESPNOW_ARG; }
+    if (mac_addr && esp_now_is_peer_exist(mac_addr) == false) { return ESP_ERR_ESPNOW_NOT_FOUND; }
+    if (send_hook) { send_hook(mac_addr, data, len); }
+    return ESP_OK;
+}
@@ -0,0 +1,61 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <Arduino.h>
+#include <esp_now.h>
+
+// The firmware runs on a PC with a virtual clock. setup(), loop() and the FreeRTOS tasks
+// are coroutines which take turns at delay(), vTaskDelay() and the blocking calls,
+// so a test runs minutes of the firmware in a moment and always the same way.
+
+// Runs setup() and then loop() forever as the loop task of Arduino.
+void host_start(void (*setup)(), void (*loop)());
+// Adds a task of the test. It runs on the virtual clock as a firmware task does.
+void host_create_task(void (*task)(void *), void *param, const char *name);
+// Runs the tasks until the clock goes ms forward.
+void host_run_for(unsigned long ms);
+uint64_t host_now_us();
+
+// Frames sent by esp_now_send() go to the hook.
+typedef void (*HostSendHook)(const uint8_t *mac_addr, const uint8_t *data, size_t len);
+void host_on_send(HostSendHook hook);
+// Hands a frame to the receive callback of ESP-NOW as the Wi-Fi task does.
+void host_receive(const uint8_t *mac_addr, const uint8_t *data, int len);
+
+// Servos call the hook with the pulse width in us.
+typedef void (*HostServoHook)(int pin, int us);
+void host_on_servo(HostServoHook hook);
+
+// Presses M5.BtnA at at_ms from the start for hold_ms. Add the presses in order.
+void host_press_button(unsigned long at_ms, unsigned long hold_ms);
+
+// The serial output goes to stdout only if HOST_SERIAL is set in the environment.
+bool host_serial_enabled();
+
+#endif
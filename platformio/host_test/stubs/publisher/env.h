@@ -0,0 +1,14 @@
+// env.h of timer_publisher for the host build. The keys are test keys only.
+const uint8_t espnow_pmk[16] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+const PeerKey display_key = {
+    { 0x02, 0x51, 0x4d, 0x00, 0x00, 0xff },
+    {
+        0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+        0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
+    },
+};
+const char* ssid     = "host";
+const char* password = "host";
@@ -0,0 +1,299 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+
+// Runs a day of info_calc with TIME_FROM_BEACON on the virtual clock and checks it after every loop().
+// temperature: every minute all day
+// humidity: every minute from 6:00 to 12:00, so it expires at 13:00
+// timer: counts down 5 minutes from 9:00, sent by the publisher of the time beacons
+// time beacons: every 10 seconds but 20:00 to 22:00. The crystal of info_calc is 30 ppm slow.
+// button A: a short press at 15:00 to advance, then a long press at 18:00 to reset
+// The keys the servos press go to CalculatorEmulator, so the test sees what the calculator shows.
+
+#include <host.h>
+#include "main.cpp"
+#include <publisher.h>
+#include "calc_emulator.h"
+
+#define TEST_HOUR               (60 * 60 * 1000UL)
+#define TEST_DAY                (24 * TEST_HOUR)
+// 2024-01-01 00:00 in JST
+#define TEST_DAY_EPOCH          (1704034800LL * 1000000LL)
+#define TEST_DRIFT_PPM          30
+#define BEACON_INTERVAL         (10 * 1000UL)
+#define BEACON_ERROR_MS         100
+#define BEACON_PAUSE_FROM       (20 * TEST_HOUR)
+#define BEACON_PAUSE_TO         (22 * TEST_HOUR)
+#define TIMER_FROM              (9 * TEST_HOUR)
+#define TIMER_SECONDS           (5 * 60)
+#define SHORT_PRESS_AT          (15 * TEST_HOUR)
+#define LONG_PRESS_AT           (18 * TEST_HOUR)
+// how far the corrected time may be off, and the local time which update_time() takes every second.
+#define MAX_TIME_ERROR_MS       20
+#define MAX_LOCAL_TIME_ERROR_S  2
+// A servo is on a key when it's this close to the key, about 0.5 degrees.
+#define KEY_PULSE_TOLERANCE_US  5
+// A broken invariant fails every loop() after it, so only the first ones are printed.
+#define MAX_REPORTED_FAILURES   20
+
+static const uint8_t sensor_mac[6] = { 0x02, 0x51, 0x4d, 0x00, 0x00, 0x01 };
+static const uint8_t timer_mac[6] = { 0x02, 0x51, 0x4d, 0x00, 0x00, 0x02 };
+static Publisher sensor_publisher;
+static Publisher timer_publisher;
+static CalculatorEmulator emulator;
+// the key each pin is on, or -1.
+static int servo_keys[64];
+static int failures = 0;
+
+// the last frames
+static unsigned long humidity_at = 0;
+static unsigned long timer_at = 0;
+static unsigned long beacon_at = 0;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond) && ++failures <= MAX_REPORTED_FAILURES) { \
+            printf("FAIL at %02lu:%02lu:%02lu.%03lu: ", millis() / TEST_HOUR, millis() / 60000 % 60, \
+                millis() / 1000 % 60, millis() % 1000); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+        } \
+    } while (0)
+
+static int64_t true_epoch_us()
+{
+    int64_t local = host_now_us();
+    return TEST_DAY_EPOCH + local + local * TEST_DRIFT_PPM / 1000000;
+}
+
+static bool sensor_transmit(const uint8_t *frame, size_t len)
+{
+    host_receive(sensor_mac, frame, len);
+    return true;
+}
+
+static bool timer_transmit(const uint8_t *frame, size_t len)
+{
+    host_receive(timer_mac, frame, len);
+    return true;
+}
+
+static void store_limit(uint32_t limit) {}
+
+// as espnow_send_time() of timer_publisher
+static void send_beacon()
+{
+    TimePayload beacon;
+    uint8_t frame[MAX_FRAME_LEN];
+
+    beacon.error_ms = BEACON_ERROR_MS;
+    uint32_t frame_seq = timer_publisher.next_seq();
+    beacon.epoch_us = true_epoch_us();
+    size_t len = frame_seal(frame, sizeof(frame), FrameTime, frame_seq, &beacon, sizeof(beacon), frame_open_key);
+    timer_transmit(frame, len);
+}
+
+static void publishers_task(void *param)
+{
+    while (true) {
+        unsigned long now = millis();
+        float hours = (float)now / TEST_HOUR;
+
+        if (now % 60000 == 0) {
+            sensor_publisher.send_value(1, 2000 + 500 * sin((hours - 9.0) * M_PI / 12.0), "°C", now);
+            if (now >= 6 * TEST_HOUR && now < 12 * TEST_HOUR) {
+                sensor_publisher.send_value(2, 6000 - hours * 100, "%", now);
+                humidity_at = now;
+            }
+        }
+        if (now >= TIMER_FROM && now <= TIMER_FROM + TIMER_SECONDS * 1000) {
+            int remains = TIMER_SECONDS - (now - TIMER_FROM) / 1000;
+            // 4:59 is sent as 4.59.
+            timer_publisher.send_value(3, remains / 60 * 100 + remains % 60, "timer", now);
+            timer_at = now;
+        }
+        if (now % BEACON_INTERVAL == 0 && (now < BEACON_PAUSE_FROM || now >= BEACON_PAUSE_TO)) {
+            send_beacon();
+            beacon_at = now;
+        }
+        delay(1000 - now % 1000);
+    }
+}
+
+// Presses a key of the emulator when a servo reaches it.
+static void on_servo(int pin, int us)
+{
+    const KeyMap *keymap = displays[0].keymap();
+    int key = -1;
+
+    for (int i = 0; i < keymap->number_of_pushers; i++) {
+        const PusherConfig *pusher = &keymap->pushers[i];
+        if (pusher->pin_no != pin) { continue; }
+        for (int k = 0; k < NumberOfKeys; k++) {
+            if (keymap->keys[k].pusher != i) { continue; }
+            int degrees = keymap->keys[k].side == SideA ? 90 - pusher->a_angle : 90 + pusher->b_angle;
+            int key_us = SERVO_MIN_US + (degrees + pusher->adjust_angle) * (SERVO_MAX_US - SERVO_MIN_US) / 180;
+            if (abs(us - key_us) <= KEY_PULSE_TOLERANCE_US) {
+                key = k;
+            }
+        }
+    }
+    if (key >= 0 && servo_keys[pin] != key) {
+        emulator.press((Key)key);
+    }
+    servo_keys[pin] = key;
+}
+
+// The calculator shows the value the planner thinks, and the target once nothing changes.
+// A loop() plans a walk at most, and it takes max_walk_presses() at most.
+static void check_display()
+{
+    static bool was_idle = false;
+    static int last_channel = -1;
+    static int last_target = 0;
+    static uint32_t last_presses = 0;
+    Display &display = displays[0];
+    Planner &planner = display.calc().planner();
+    uint32_t bound = max_walk_presses(planner.walk_places());
+
+    CHECK(planner.presses() - last_presses <= bound, "%u presses planned at once, over %u",
+        planner.presses() - last_presses, bound);
+    last_presses = planner.presses();
+    int ch = display.current_channel();
+    int target = ch == 0 || channels.available(ch) == false ?
+        currentTime.tm_hour * 100 + currentTime.tm_min : channels.get(ch)->value;
+
+    bool idle = display.actuator().busy() == false && planner.current_mode() != Planner::Unknown;
+    if (idle) {
+        // The servos pressed every planned key and nothing else.
+        CHECK(display.actuator().pressed_count() == planner.presses(), "%u presses, %u planned",
+            display.actuator().pressed_count(), planner.presses());
+        CHECK(emulator.error() == false && emulator.display() == planner.value(),
+            "the calculator shows %lld%s, the planner thinks %d", (long long)emulator.display(),
+            emulator.error() ? " E" : "", planner.value());
+        // show() had the same target in the last loop() and pressed nothing.
+        if (was_idle && ch == last_channel && target == last_target && time_available) {
+            CHECK(planner.value() == target, "ch %d shows %d, not %d", ch, planner.value(), target);
+        }
+    }
+    was_idle = idle;
+    last_channel = ch;
+    last_target = target;
+}
+
+static void check_channels(unsigned long now)
+{
+    ChannelValue *humidity = channels.get(2);
+    uint32_t interval = config_store.config()->invalid_data_interval;
+
+    if (now >= 60000) {
+        CHECK(channels.available(1), "the temperature is not available");
+    }
+    if (humidity_at) {
+        unsigned long age = now - humidity->received_at;
+        if (age + 1000 < interval) {
+            CHECK(channels.available(2), "the humidity of %lu s ago is not available", age / 1000);
+        } else
+        if (age > interval + 1000) {
+            CHECK(channels.available(2) == false, "the humidity of %lu s ago is still available", age / 1000);
+        }
+    }
+
+    // A timer is shown as soon as it comes, and it's gone after the rounding interval.
+    if (timer_at && now - timer_at + 1000 < config_store.config()->rounding_interval) {
+        CHECK(displays[0].current_channel() == 3, "ch %d is shown during the timer", displays[0].current_channel());
+    }
+    if (timer_at && now - timer_at > config_store.config()->rounding_interval + 1000) {
+        CHECK(channels.available(3) == false, "the timer is still available");
+    }
+}
+
+static void check_time(unsigned long now)
+{
+    if (beacon_at == 0 || now - beacon_at < 1000) { return; }
+
+    int64_t error_us = time_service.now_us() - true_epoch_us();
+    CHECK(llabs(error_us) <= MAX_TIME_ERROR_MS * 1000, "the time is %lld ms off", (long long)(error_us / 1000));
+
+    // update_time() takes the local time once in 100 loops.
+    time_t t = true_epoch_us() / 1000000 + gmtOffset_sec;
+    struct tm truth;
+    gmtime_r(&t, &truth);
+    long diff = (truth.tm_hour * 3600 + truth.tm_min * 60 + truth.tm_sec) -
+        (currentTime.tm_hour * 3600 + currentTime.tm_min * 60 + currentTime.tm_sec);
+    // across midnight
+    diff = (diff + 86400 + 43200) % 86400 - 43200;
+    CHECK(time_available && labs(diff) <= MAX_LOCAL_TIME_ERROR_S, "the local time is %ld s off", diff);
+}
+
+// loop() of the firmware and the checks after it.
+static void test_loop()
+{
+    static unsigned long next_report = TEST_HOUR;
+    static uint32_t presses_at_hour = 0;
+    int previous = displays[0].current_channel();
+
+    loop();
+
+    unsigned long now = millis();
+    int ch = displays[0].current_channel();
+    if (M5.BtnA.wasPressed()) {
+        CHECK(ch == channels.next_available(previous), "ch %d after a press on ch %d", ch, previous);
+    }
+    if (M5.BtnA.wasReleaseFor(1000)) {
+        CHECK(ch == 0, "ch %d after a long press", ch);
+    }
+    check_display();
+    check_channels(now);
+    check_time(now);
+
+    if (now >= next_report) {
+        next_report += TEST_HOUR;
+        uint32_t presses = displays[0].actuator().pressed_count();
+        printf("%02lu:00 presses %u, showing ch %d, available 1:%d 2:%d 3:%d, time %+lld ms, drift %.1f ppm\n",
+            now / TEST_HOUR, presses - presses_at_hour, ch, channels.available(1), channels.available(2),
+            channels.available(3), (long long)((time_service.now_us() - true_epoch_us()) / 1000),
+            time_service.drift_ppm());
+        presses_at_hour = presses;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    memset(servo_keys, -1, sizeof(servo_keys));
+    host_on_servo(on_servo);
+    host_press_button(SHORT_PRESS_AT, 100);
+    host_press_button(LONG_PRESS_AT, 1500);
+    sensor_publisher.begin(frame_open_key, 0, store_limit, sensor_transmit, false);
+    timer_publisher.begin(frame_open_key, 0, store_limit, timer_transmit, false);
+
+    host_start(setup, test_loop);
+    // The calculator is cleared by the first keys.
+    emulator.begin(default_keymap.digits);
+    host_create_task(publishers_task, NULL, "publishers");
+    host_run_for(TEST_DAY);
+
+    printf("virtual_day: %u presses, %s\n", displays[0].actuator().pressed_count(), failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,214 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _ACTUATOR_H_
+#define _ACTUATOR_H_
+
+#include "keymap.h"
+#include "pusher.h"
+#include "press_sensor.h"
+
+// It must hold the longest sequence the calculator plans at once.
+#define KEY_QUEUE_SIZE          128
+// presses of CA again when the sensor doesn't confirm it.
+#define MAX_PRESS_RETRIES       2
+
+// Presses queued keys one by one without blocking the caller.
+// The planner pushes keys from loop() and the actuator task presses them, so the queue is locked.
+// With a press sensor, a press which isn't confirmed is tried again. When it still fails,
+// the rest of the keys are dropped and lost() tells the display to clear the calculator.
+class Actuator
+{
+private:
+    const KeyMap *_keymap = NULL;
+    Pusher _pushers[MAX_PUSHERS];
+    Key _queue[KEY_QUEUE_SIZE];
+    int _head = 0;
+    int _count = 0;
+    // index of the pusher which is pressing, or -1.
+    int _pressing = -1;
+    uint32_t _pressed_count = 0;
+    portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+    // NULL if the presses are not sensed.
+    PressSensor *_sensor = NULL;
+    Key _key = KeyEqual;
+    int _retries = 0;
+    bool _lost = false;
+    uint32_t _confirmed_count = 0;
+    uint32_t _retried_count = 0;
+    uint32_t _lost_count = 0;
+
+    void press(Key key, unsigned long now)
+    {
+        const KeyAssign *assign = &_keymap->keys[key];
+        _key = key;
+        if (_sensor) { _sensor->start(); }
+        _pushers[assign->pusher].press((PusherSide)assign->side, now);
+        _pressed_count++;
+        Serial.printf("%c", key_chars[key]);
+    }
+
+    // Checks the finished press. Returns true if it presses the key again.
+    // Only CA is pressed again. If the sensor missed a press of another key,
+    // pressing it again would add a digit or a step, so the calculator is cleared instead.
+    bool verify(unsigned long now)
+    {
+        if (_sensor->confirmed())
+        {
+            _confirmed_count++;
+            _retries = 0;
+            return false;
+        }
+        if (_key == KeyClearAll && _retries < MAX_PRESS_RETRIES)
+        {
+            _retries++;
+            _retried_count++;
+            Serial.print("?");
+            press(_key, now);
+            return true;
+        }
+
+        // The calculator may show anything now.
+        Serial.print("!");
+        _retries = 0;
+        _lost_count++;
+        portENTER_CRITICAL(&_lock);
+        _count = 0;
+        _lost = true;
+        portEXIT_CRITICAL(&_lock);
+        return false;
+    }
+
+public:
+
+    void begin(const KeyMap *keymap, PressSensor *sensor = NULL)
+    {
+        _keymap = keymap;
+        _sensor = sensor && sensor->enabled() ? sensor : NULL;
+        for (int i = 0; i < _keymap->number_of_pushers; i++)
+        {
+            _pushers[i].configure(&_keymap->pushers[i]);
+            _pushers[i].begin();
+        }
+    }
+
+    // Takes the pusher configs of the key map again. Call it while it's not busy.
+    void reconfigure()
+    {
+        for (int i = 0; i < _keymap->number_of_pushers; i++)
+        {
+            _pushers[i].configure(&_keymap->pushers[i]);
+        }
+    }
+
+    bool push(Key key)
+    {
+        portENTER_CRITICAL(&_lock);
+        bool full = _count >= KEY_QUEUE_SIZE;
+        if (full == false)
+        {
+            _queue[(_head + _count) % KEY_QUEUE_SIZE] = key;
+            _count++;
+        }
+        portEXIT_CRITICAL(&_lock);
+
+        if (full)
+        {
+            Serial.println("The key queue is full.");
+        }
+        return full == false;
+    }
+
+    bool busy()
+    {
+        portENTER_CRITICAL(&_lock);
+        bool busy = _count > 0 || _pressing >= 0;
+        portEXIT_CRITICAL(&_lock);
+        return busy;
+    }
+
+    uint32_t pressed_count() { return _pressed_count; }
+    uint32_t confirmed_count() { return _confirmed_count; }
+    uint32_t retried_count() { return _retried_count; }
+    uint32_t lost_count() { return _lost_count; }
+
+    // True once after a press has failed.
+    bool lost()
+    {
+        portENTER_CRITICAL(&_lock);
+        bool lost = _lost;
+        _lost = false;
+        portEXIT_CRITICAL(&_lock);
+        return lost;
+    }
+
+    // Call it from one task only.
+    void update(unsigned long now)
+    {
+        if (_pressing >= 0)
+        {
+            Pusher &pusher = _pushers[_pressing];
+            bool pressing = pusher.update(now);
+            if (_sensor && pusher.on_key(now)) { _sensor->sample(); }
+            if (pressing) { return; }
+            if (_sensor && verify(now)) { return; }
+        }
+        else
+        if (_sensor)
+        {
+            _sensor->idle();
+        }
+
+        // busy() stays true from taking the key to pressing it.
+        portENTER_CRITICAL(&_lock);
+        bool taken = _count > 0;
+        Key key = _queue[_head];
+        if (taken)
+        {
+            _head = (_head + 1) % KEY_QUEUE_SIZE;
+            _count--;
+            _pressing = _keymap->keys[key].pusher;
+        }
+        else
+        {
+            _pressing = -1;
+        }
+        portEXIT_CRITICAL(&_lock);
+        if (taken == false) { return; }
+
+        press(key, now);
+    }
+
+    // Blocks until the actuator task presses all queued keys.
+    void flush()
+    {
+        while (busy())
+        {
+            delay(1);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,174 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _CALC_EMULATOR_H_
+#define _CALC_EMULATOR_H_
+
+#include "keymap.h"
+
+// Emulates a calculator with the constant calculation, for the host tests.
+// "+ . 0 1 =" adds 0.01 and each "=" after it adds 0.01 again.
+// Values are in hundredths like Planner. It keeps the displayed value only.
+class CalculatorEmulator
+{
+private:
+    int _digits = 12;
+    int64_t _display = 0;
+    int64_t _accumulator = 0;
+    // the operator waiting for "=", or 0.
+    char _operator = 0;
+    // the constant which "=" repeats.
+    char _constant_operator = 0;
+    int64_t _constant = 0;
+    bool _entering = false;
+    int64_t _entry = 0;
+    // digits after the dot, or -1 before the dot.
+    int _decimals = -1;
+    bool _error = false;
+
+    void start_entry()
+    {
+        if (_entering) { return; }
+        _entering = true;
+        _entry = 0;
+        _decimals = -1;
+    }
+
+    void enter_digit(int n)
+    {
+        start_entry();
+        if (_decimals < 0) {
+            _entry = _entry * 10 + n * 100;
+        } else
+        if (_decimals == 0) {
+            _entry += n * 10;
+            _decimals++;
+        } else
+        if (_decimals == 1) {
+            _entry += n;
+            _decimals++;
+        }
+        _display = _entry;
+    }
+
+    int64_t calculate(char op, int64_t a, int64_t b)
+    {
+        int64_t v = op == '+' ? a + b : a - b;
+        int64_t limit = 1;
+        for (int i = 0; i < _digits; i++) {
+            limit *= 10;
+        }
+        if (v >= limit || v <= -limit) {
+            _error = true;
+        }
+        return v;
+    }
+
+public:
+
+    void begin(int digits)
+    {
+        _digits = digits;
+        clear();
+    }
+
+    void clear()
+    {
+        _display = _accumulator = _constant = _entry = 0;
+        _operator = _constant_operator = 0;
+        _entering = false;
+        _decimals = -1;
+        _error = false;
+    }
+
+    int64_t display() { return _display; }
+    bool error() { return _error; }
+
+    void press(Key key)
+    {
+        if (key == KeyClearAll) {
+            clear();
+            return;
+        }
+        // Only CA works after an error.
+        if (_error) { return; }
+
+        switch (key) {
+        case KeyZero:
+            enter_digit(0);
+            break;
+        case KeyOne:
+            enter_digit(1);
+            break;
+        case KeyDot:
+            start_entry();
+            if (_decimals < 0) {
+                _decimals = 0;
+            }
+            _display = _entry;
+            break;
+
+        case KeyPlus:
+        case KeyMinus:
+            if (_operator && _entering) {
+                _display = calculate(_operator, _accumulator, _entry);
+            }
+            _accumulator = _display;
+            _operator = key == KeyPlus ? '+' : '-';
+            _entering = false;
+            break;
+
+        case KeyEqual:
+            if (_operator) {
+                _constant = _entering ? _entry : _accumulator;
+                _constant_operator = _operator;
+                _display = calculate(_operator, _accumulator, _constant);
+                _operator = 0;
+            } else
+            if (_constant_operator) {
+                _display = calculate(_constant_operator, _display, _constant);
+            }
+            _entering = false;
+            break;
+
+        default:
+            break;
+        }
+    }
+};
+
+// The most presses of a walk over the places without clearing:
+// "CA =", then "=" 10 times at most and the constant for each place.
+// The constant of the place 0 is "+ . 0 1" and the one of the place 4 is "+ 1 0 0".
+static uint32_t max_walk_presses(int places)
+{
+    uint32_t presses = 2;
+    for (int place = 0; place < places; place++) {
+        presses += 10 + (place == 0 ? 4 : place == 1 ? 3 : place);
+    }
+    return presses;
+}
+
+#endif
@@ -0,0 +1,266 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _CHANNEL_TABLE_H_
+#define _CHANNEL_TABLE_H_
+
+// Channel 0 is for time. The others are sent by publishers.
+#define MAX_CHANNELS            256
+// The link counts are halved at this many frames, so that they show the recent frames.
+#define LINK_WINDOW             64
+
+struct ChannelValue {
+    // in hundredths of the unit
+    int32_t value;
+    unsigned long received_at;
+    bool available;
+    char unit[16];
+    // the health of the link from the publisher.
+    // dBm, or 0 if unknown
+    int8_t rssi;
+    // Lost frames are known from the sequence numbers of framed values only.
+    bool sequenced;
+    uint16_t received;
+    uint16_t lost;
+};
+
+// Holds the values of all channels.
+// Available channels are kept in a bitmap and the expiry deadlines in a min-heap,
+// so that loop() doesn't scan all channels every tick.
+class ChannelTable
+{
+private:
+    struct Deadline {
+        unsigned long at;
+        uint16_t ch;
+    };
+
+    ChannelValue _values[MAX_CHANNELS];
+    uint32_t _available[MAX_CHANNELS / 32];
+    Deadline _heap[MAX_CHANNELS];
+    // position of each channel in the heap, or -1.
+    int16_t _heap_index[MAX_CHANNELS];
+    int _heap_size = 0;
+    unsigned long _interval;
+    // It's updated from the receive callback and loop().
+    portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+
+    void set_available(int ch, bool f)
+    {
+        _values[ch].available = f;
+        if (f) {
+            _available[ch / 32] |= 1UL << (ch % 32);
+        } else {
+            _available[ch / 32] &= ~(1UL << (ch % 32));
+        }
+    }
+
+    // millis() wraps around, so compare the difference.
+    bool earlier(int i, int j)
+    {
+        return (long)(_heap[i].at - _heap[j].at) < 0;
+    }
+
+    void swap(int i, int j)
+    {
+        Deadline d = _heap[i];
+        _heap[i] = _heap[j];
+        _heap[j] = d;
+        _heap_index[_heap[i].ch] = i;
+        _heap_index[_heap[j].ch] = j;
+    }
+
+    void sift_up(int i)
+    {
+        while (i > 0) {
+            int parent = (i - 1) / 2;
+            if (earlier(i, parent) == false) { break; }
+            swap(i, parent);
+            i = parent;
+        }
+    }
+
+    void sift_down(int i)
+    {
+        while (true) {
+            int left = i * 2 + 1;
+            int right = left + 1;
+            int smallest = i;
+            if (left < _heap_size && earlier(left, smallest)) { smallest = left; }
+            if (right < _heap_size && earlier(right, smallest)) { smallest = right; }
+            if (smallest == i) { break; }
+            swap(i, smallest);
+            i = smallest;
+        }
+    }
+
+    void remove_deadline(int ch)
+    {
+        int i = _heap_index[ch];
+        if (i < 0) { return; }
+
+        _heap_size--;
+        if (i != _heap_size) {
+            swap(i, _heap_size);
+            int moved = _heap[i].ch;
+            sift_up(i);
+            sift_down(_heap_index[moved]);
+        }
+        _heap_index[ch] = -1;
+    }
+
+    void set_deadline(int ch, unsigned long at)
+    {
+        int i = _heap_index[ch];
+        if (i < 0) {
+            i = _heap_size++;
+            _heap[i].ch = ch;
+            _heap_index[ch] = i;
+        }
+        _heap[i].at = at;
+        sift_up(i);
+        sift_down(_heap_index[ch]);
+    }
+
+public:
+
+    ChannelTable(unsigned long interval)
+    {
+        _interval = interval;
+        for (int i = 0; i < MAX_CHANNELS; i++) {
+            _values[i].available = false;
+            _values[i].value = 0;
+            _values[i].received_at = 0;
+            _values[i].unit[0] = '\0';
+            _values[i].rssi = 0;
+            _values[i].sequenced = false;
+            _values[i].received = _values[i].lost = 0;
+            _heap_index[i] = -1;
+        }
+        memset(_available, 0, sizeof(_available));
+        // channel zero is for time.
+        set_available(0, true);
+    }
+
+    // ms until a value is dropped. The values received before keep their deadlines.
+    unsigned long interval() const { return _interval; }
+    void set_interval(unsigned long interval) { _interval = interval; }
+
+    ChannelValue *get(int ch) { return &_values[ch]; }
+
+    bool available(int ch) { return _values[ch].available; }
+
+    bool valid_channel(int ch) { return ch >= 1 && ch < MAX_CHANNELS; }
+
+    // Returns true if the value or the unit is changed.
+    bool update(int ch, int32_t value, const char *unit, unsigned long now)
+    {
+        portENTER_CRITICAL(&_mux);
+        ChannelValue *channel_value = &_values[ch];
+        bool changed = channel_value->available == false || channel_value->value != value || strncmp(channel_value->unit, unit, sizeof(channel_value->unit) - 1) != 0;
+        channel_value->value = value;
+        channel_value->received_at = now;
+        strncpy(channel_value->unit, unit, sizeof(channel_value->unit) - 1);
+        channel_value->unit[sizeof(channel_value->unit) - 1] = '\0';
+        set_available(ch, true);
+        set_deadline(ch, now + _interval);
+        portEXIT_CRITICAL(&_mux);
+        return changed;
+    }
+
+    // Counts a received frame and the frames lost before it.
+    void record_link(int ch, int rssi, bool sequenced, uint32_t lost)
+    {
+        portENTER_CRITICAL(&_mux);
+        ChannelValue *channel_value = &_values[ch];
+        if (rssi != 0) {
+            channel_value->rssi = channel_value->rssi == 0 ? rssi : (channel_value->rssi * 3 + rssi) / 4;
+        }
+        channel_value->sequenced = sequenced;
+        channel_value->received++;
+        channel_value->lost += min(lost, (uint32_t)LINK_WINDOW);
+        if (channel_value->received + channel_value->lost >= 2 * LINK_WINDOW) {
+            channel_value->received /= 2;
+            channel_value->lost /= 2;
+        }
+        portEXIT_CRITICAL(&_mux);
+    }
+
+    // Percentage of the lost frames, or -1 if unknown.
+    int drop_percent(int ch)
+    {
+        ChannelValue *channel_value = &_values[ch];
+        int total = channel_value->received + channel_value->lost;
+        if (channel_value->sequenced == false || total == 0) { return -1; }
+        return channel_value->lost * 100 / total;
+    }
+
+    void invalidate(int ch)
+    {
+        if (ch == 0) { return; }
+
+        portENTER_CRITICAL(&_mux);
+        set_available(ch, false);
+        remove_deadline(ch);
+        portEXIT_CRITICAL(&_mux);
+    }
+
+    // Invalidates the channels which are not received within the interval.
+    // Returns the number of invalidated channels.
+    int expire(unsigned long now)
+    {
+        int n = 0;
+
+        portENTER_CRITICAL(&_mux);
+        while (_heap_size > 0 && (long)(now - _heap[0].at) >= 0) {
+            int ch = _heap[0].ch;
+            set_available(ch, false);
+            remove_deadline(ch);
+            n++;
+        }
+        portEXIT_CRITICAL(&_mux);
+        return n;
+    }
+
+    // Returns the next available channel after ch in the cyclic order.
+    // Channel 0 is always available, so it returns 0 at worst.
+    int next_available(int ch)
+    {
+        int start = (ch + 1) % MAX_CHANNELS;
+        int word = start / 32;
+        uint32_t bits = _available[word] & (0xffffffffUL << (start % 32));
+
+        for (int i = 0; i <= MAX_CHANNELS / 32; i++) {
+            if (bits) {
+                return word * 32 + __builtin_ctz(bits);
+            }
+            word = (word + 1) % (MAX_CHANNELS / 32);
+            bits = _available[word];
+        }
+        return 0;
+    }
+};
+
+#endif
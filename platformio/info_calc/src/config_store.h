@@ -0,0 +1,204 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _CONFIG_STORE_H_
+#define _CONFIG_STORE_H_
+
+#include <Preferences.h>
+#include <protocol.h>
+#include "keymap.h"
+#include "scheduler.h"
+
+#define CONFIG_LAYOUT           1
+
+#define MIN_ROUNDING_INTERVAL   (5 * 1000UL)
+#define MAX_ROUNDING_INTERVAL   (10 * 60 * 1000UL)
+#define MIN_INVALID_INTERVAL    (60 * 1000UL)
+#define MAX_INVALID_INTERVAL    (24 * 60 * 60 * 1000UL)
+#define MAX_MIN_DWELL           600
+
+// Parameters which an admin publisher can change without reflashing.
+// It is stored into NVS as a blob, so keep it a plain struct.
+struct RuntimeConfig {
+    uint16_t layout;
+    // It counts up with each applied change.
+    uint32_t revision;
+    uint32_t rounding_interval;
+    uint32_t invalid_data_interval;
+    uint8_t brightness;
+    // They replace the ones of all pushers, or 0 to use the key map.
+    uint16_t max_speed;
+    uint16_t max_accel;
+    uint16_t hold_time;
+    ChannelPolicy policies[MAX_CHANNELS];
+
+    // Returns false if the parameter is unknown or the value is out of range.
+    bool set(const ControlItem *item)
+    {
+        int32_t v = item->value;
+        ChannelPolicy *policy = &policies[item->index];
+
+        switch (item->param) {
+        case ParamRoundingInterval:
+            if (v < (int32_t)MIN_ROUNDING_INTERVAL || v > (int32_t)MAX_ROUNDING_INTERVAL) { return false; }
+            rounding_interval = v;
+            return true;
+        case ParamInvalidDataInterval:
+            if (v < (int32_t)MIN_INVALID_INTERVAL || v > (int32_t)MAX_INVALID_INTERVAL) { return false; }
+            invalid_data_interval = v;
+            return true;
+        case ParamBrightness:
+            if (v < 1 || v > 255) { return false; }
+            brightness = v;
+            return true;
+        case ParamMaxSpeed:
+            if (v != 0 && (v < MIN_SERVO_SPEED || v > MAX_SERVO_SPEED)) { return false; }
+            max_speed = v;
+            return true;
+        case ParamMaxAccel:
+            if (v != 0 && (v < MIN_SERVO_ACCEL || v > MAX_SERVO_ACCEL)) { return false; }
+            max_accel = v;
+            return true;
+        case ParamHoldTime:
+            if (v != 0 && (v < MIN_PUSH_TIME || v > MAX_PUSH_TIME)) { return false; }
+            hold_time = v;
+            return true;
+        }
+
+        // Channel 0 is the clock and has no policy.
+        if (item->index == 0) { return false; }
+        switch (item->param) {
+        case ParamPriority:
+            if (v < 0 || v > 255) { return false; }
+            policy->priority = v;
+            return true;
+        case ParamStalenessWeight:
+            if (v < 0 || v > 255) { return false; }
+            policy->staleness_weight = v;
+            return true;
+        case ParamMinDwell:
+            if (v < 0 || v > MAX_MIN_DWELL) { return false; }
+            policy->min_dwell = v;
+            return true;
+        case ParamShowOnChange:
+            if (v != 0 && v != 1) { return false; }
+            policy->show_on_change = v;
+            return true;
+        }
+        return false;
+    }
+
+    // Applies the servo timings to a key map.
+    void override_keymap(KeyMap *keymap) const
+    {
+        for (int i = 0; i < keymap->number_of_pushers; i++) {
+            PusherConfig *pusher = &keymap->pushers[i];
+            if (max_speed) { pusher->max_speed = max_speed; }
+            if (max_accel && pusher->max_speed) { pusher->max_accel = max_accel; }
+            if (hold_time && pusher->max_speed) { pusher->hold_time = hold_time; }
+        }
+    }
+};
+
+// Keeps the runtime config in NVS and applies a control frame to it.
+class ConfigStore
+{
+private:
+    RuntimeConfig _active;
+    // A change is made on it and copied to _active only when all items are valid.
+    RuntimeConfig _pending;
+
+public:
+
+    // Call it with the compiled defaults. A stored config of another layout is ignored.
+    void begin(const RuntimeConfig *defaults)
+    {
+        _active = *defaults;
+        _active.layout = CONFIG_LAYOUT;
+        if (load()) {
+            Serial.printf("The config revision %u is loaded from NVS.\n", _active.revision);
+        }
+    }
+
+    const RuntimeConfig *config() const { return &_active; }
+    uint32_t revision() const { return _active.revision; }
+
+    bool load()
+    {
+        Preferences prefs;
+
+        if (prefs.begin("config", true) == false) { return false; }
+        bool loaded = prefs.getBytesLength("runtime") == sizeof(_pending) &&
+            prefs.getBytes("runtime", &_pending, sizeof(_pending)) == sizeof(_pending);
+        prefs.end();
+        if (loaded == false || _pending.layout != CONFIG_LAYOUT) { return false; }
+        _active = _pending;
+        return true;
+    }
+
+    // NVS writes the blob as a whole, so a reset keeps the old one or the new one.
+    // Writing the flash stalls the other tasks, so save a copy without the lock of the state.
+    static bool save(const RuntimeConfig *config)
+    {
+        Preferences prefs;
+
+        if (prefs.begin("config", false) == false) { return false; }
+        bool saved = prefs.putBytes("runtime", config, sizeof(*config)) == sizeof(*config);
+        prefs.end();
+        return saved;
+    }
+
+    // Applies the items of a control frame. It's called with the lock of the state,
+    // so the others see the old config or the new one, never a mix of them.
+    // It doesn't store the config even with CONTROL_PERSIST. The caller saves it after the lock.
+    ControlReply apply(const ControlHeader *header, const ControlItem *items)
+    {
+        ControlReply reply = { 0, _active.revision, ControlApplied, 0 };
+
+        // The revision starts at 1, so base_revision 0 is stale too.
+        if (header->base_revision != _active.revision) {
+            reply.status = ControlStale;
+            return reply;
+        }
+
+        _pending = _active;
+        for (int i = 0; i < header->count; i++) {
+            ControlItem item;
+            // The items are not aligned in the frame.
+            memcpy(&item, &items[i], sizeof(item));
+            if (_pending.set(&item) == false) {
+                reply.status = ControlInvalid;
+                reply.item = i;
+                return reply;
+            }
+        }
+        _pending.revision++;
+        _active = _pending;
+        reply.revision = _active.revision;
+        return reply;
+    }
+};
+
+#endif
@@ -0,0 +1,138 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include "channel_table.h"
+
+struct FilterConfig {
+    // Ignore changes smaller than this in hundredths. 0 to disable.
+    uint16_t deadband;
+    // EMA weight of a new sample is 1 / 2^ema_shift. 0 to disable.
+    uint8_t ema_shift;
+    // Take the median of the last three samples before the EMA.
+    bool median;
+    // seconds to hold a shown value before showing another one. 0 to disable.
+    uint16_t min_interval;
+};
+
+static const FilterConfig default_filter_config = { 5, 2, true, 10 };
+
+// The EMA keeps this many bits below a hundredth, so that small steps add up.
+#define EMA_FRACTION_BITS       16
+
+// Smooths noisy sensor values so that jitter doesn't turn into presses.
+class ChannelFilter
+{
+private:
+    struct State {
+        int32_t samples[3];
+        int64_t ema;
+        int32_t shown;
+        unsigned long shown_at;
+        // samples so far, up to 255. 0 until the first sample.
+        uint8_t count;
+        // the slot of samples for the next sample.
+        uint8_t next;
+    };
+
+    FilterConfig _configs[MAX_CHANNELS];
+    State _states[MAX_CHANNELS];
+
+    static int32_t median_of(const int32_t *v)
+    {
+        int32_t a = v[0], b = v[1], c = v[2];
+        if (a > b) { int32_t t = a; a = b; b = t; }
+        if (b > c) { b = c; }
+        return a > b ? a : b;
+    }
+
+public:
+
+    ChannelFilter()
+    {
+        for (int i = 0; i < MAX_CHANNELS; i++) {
+            _configs[i] = default_filter_config;
+        }
+        reset();
+    }
+
+    void reset()
+    {
+        memset(_states, 0, sizeof(_states));
+    }
+
+    void reset(int ch)
+    {
+        memset(&_states[ch], 0, sizeof(_states[ch]));
+    }
+
+    FilterConfig *config(int ch) { return &_configs[ch]; }
+
+    // Returns the value to show. Values are in hundredths.
+    int32_t apply(int ch, int32_t value, unsigned long now)
+    {
+        const FilterConfig *config = &_configs[ch];
+        State *state = &_states[ch];
+
+        // The first sample is shown as it is.
+        if (state->count == 0) {
+            for (int i = 0; i < 3; i++) { state->samples[i] = value; }
+            state->ema = (int64_t)value << EMA_FRACTION_BITS;
+            state->shown = value;
+            state->shown_at = now;
+            state->count = 1;
+            state->next = 1;
+            return value;
+        }
+
+        int32_t sample = value;
+        if (config->median) {
+            state->samples[state->next] = value;
+            state->next = (state->next + 1) % 3;
+            sample = median_of(state->samples);
+        }
+        if (state->count < 255) { state->count++; }
+
+        int64_t target = (int64_t)sample << EMA_FRACTION_BITS;
+        if (config->ema_shift > 0) {
+            state->ema += (target - state->ema) / (1 << config->ema_shift);
+        } else {
+            state->ema = target;
+        }
+
+        // rounded to the nearest hundredth
+        int32_t ema = (state->ema + (1 << (EMA_FRACTION_BITS - 1))) >> EMA_FRACTION_BITS;
+        if (abs(ema - state->shown) < config->deadband) { return state->shown; }
+        if (now - state->shown_at < config->min_interval * 1000UL) { return state->shown; }
+
+        state->shown = ema;
+        state->shown_at = now;
+        return state->shown;
+    }
+};
+
+#endif
@@ -0,0 +1,246 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef _KEYMAP_H_
+#define _KEYMAP_H_
+
+#include <stddef.h>
+#include <Preferences.h>
+#include "motion.h"
+
+// Keys of the calculator which the pushers can press.
+typedef enum
+{
+    KeyEqual,
+    KeyPlus,
+    KeyMinus,
+    KeyDot,
+    KeyZero,
+    KeyOne,
+    KeyClearAll,
+
+    NumberOfKeys,
+} Key;
+
+// Characters for the log. The order is same as Key.
+static const char key_chars[] = "=+-.01C";
+
+typedef enum
+{
+    SideA,
+    SideB,
+} PusherSide;
+
+#define MAX_PUSHERS         4
+#define KEYMAP_VERSION      2
+
+#define MIN_DIGITS          5
+#define MAX_DIGITS          16
+#define MAX_PUSH_ANGLE      45
+#define MIN_PUSH_TIME       20
+#define MAX_PUSH_TIME       2000
+// deg/s and deg/s^2 of the motion profile
+#define MIN_SERVO_SPEED     50
+#define MAX_SERVO_SPEED     1000
+#define MIN_SERVO_ACCEL     1000
+#define MAX_SERVO_ACCEL     60000
+
+struct PusherConfig {
+    uint8_t pin_no;
+    // angles from the rest to where the pusher stops on the key.
+    uint8_t a_angle;
+    uint8_t b_angle;
+    int8_t adjust_angle;
+    // The servo jumps to the angle and waits these times when max_speed is 0.
+    uint16_t on_time;
+    uint16_t off_time;
+    // The motion profile. It moves along a trapezoid, holds the key and comes back.
+    uint16_t max_speed;
+    uint16_t max_accel;
+    uint16_t hold_time;
+
+    int side_angle(PusherSide side) const
+    {
+        return side == SideA ? a_angle : b_angle;
+    }
+
+    // Time in ms from leaving the rest to leaving the key.
+    uint32_t press_on_time(PusherSide side) const
+    {
+        if (max_speed == 0) { return on_time; }
+        return motion_time(side_angle(side), max_speed, max_accel) + hold_time;
+    }
+
+    // Time in ms from leaving the key to being back at the rest.
+    uint32_t press_off_time(PusherSide side) const
+    {
+        if (max_speed == 0) { return off_time; }
+        return motion_time(side_angle(side), max_speed, max_accel);
+    }
+};
+
+struct KeyAssign {
+    // -1 means that no pusher is assigned to the key.
+    int8_t pusher;
+    uint8_t side;
+};
+
+// Describes a calculator and how the pushers are arranged on it.
+// It is stored into NVS as a blob, so keep it a plain struct.
+struct KeyMap {
+    uint16_t version;
+    // number of digits the calculator can display.
+    uint8_t digits;
+    uint8_t number_of_pushers;
+    PusherConfig pushers[MAX_PUSHERS];
+    KeyAssign keys[NumberOfKeys];
+    // press_time() of the keys. It is not stored, call update_press_times() after changing the map.
+    uint32_t press_times[NumberOfKeys];
+
+    // bytes of the blob in NVS
+    static size_t stored_size()
+    {
+        return offsetof(KeyMap, press_times);
+    }
+
+    bool has_key(Key key) const
+    {
+        return keys[key].pusher >= 0;
+    }
+
+    // Time in ms to press and release the key.
+    // The planner counts the cost of a sequence with it.
+    uint32_t press_time(Key key) const
+    {
+        return press_times[key];
+    }
+
+    // Plans the motion of every key once, so that the planner doesn't plan it for each key it counts.
+    void update_press_times()
+    {
+        for (int i = 0; i < NumberOfKeys; i++) {
+            press_times[i] = 0;
+            if (has_key((Key)i) == false) { continue; }
+            const PusherConfig *config = &pushers[keys[i].pusher];
+            PusherSide side = (PusherSide)keys[i].side;
+            press_times[i] = config->press_on_time(side) + config->press_off_time(side);
+        }
+    }
+
+    // Returns NULL if it is valid, otherwise the reason.
+    const char *validate() const
+    {
+        if (version != KEYMAP_VERSION) { return "unknown version"; }
+        if (digits < MIN_DIGITS || digits > MAX_DIGITS) { return "digits out of range"; }
+        if (number_of_pushers < 1 || number_of_pushers > MAX_PUSHERS) { return "number of pushers out of range"; }
+
+        for (int i = 0; i < number_of_pushers; i++) {
+            const PusherConfig *config = &pushers[i];
+            if (config->a_angle > MAX_PUSH_ANGLE || config->b_angle > MAX_PUSH_ANGLE) { return "angle out of range"; }
+            if (abs(config->adjust_angle) > MAX_PUSH_ANGLE) { return "adjust angle out of range"; }
+            if (config->on_time < MIN_PUSH_TIME || config->on_time > MAX_PUSH_TIME) { return "on time out of range"; }
+            if (config->off_time < MIN_PUSH_TIME || config->off_time > MAX_PUSH_TIME) { return "off time out of range"; }
+            if (config->max_speed != 0) {
+                if (config->max_speed < MIN_SERVO_SPEED || config->max_speed > MAX_SERVO_SPEED) { return "speed out of range"; }
+                if (config->max_accel < MIN_SERVO_ACCEL || config->max_accel > MAX_SERVO_ACCEL) { return "acceleration out of range"; }
+                if (config->hold_time < MIN_PUSH_TIME || config->hold_time > MAX_PUSH_TIME) { return "hold time out of range"; }
+            }
+            for (int j = 0; j < i; j++) {
+                if (pushers[j].pin_no == config->pin_no) { return "duplicated pin"; }
+            }
+        }
+
+        for (int i = 0; i < NumberOfKeys; i++) {
+            const KeyAssign *assign = &keys[i];
+            // Every key is needed to walk the value.
+            if (assign->pusher < 0) { return "a required key is not assigned"; }
+            if (assign->pusher >= number_of_pushers) { return "pusher index out of range"; }
+            if (assign->side != SideA && assign->side != SideB) { return "unknown side"; }
+            for (int j = 0; j < i; j++) {
+                if (keys[j].pusher == assign->pusher && keys[j].side == assign->side) { return "duplicated key assign"; }
+            }
+        }
+        return NULL;
+    }
+
+    // Loads the key map from NVS. It keeps the current one if NVS has no valid key map.
+    bool load(const char *name = "map")
+    {
+        Preferences prefs;
+        KeyMap stored;
+
+        if (prefs.begin("keymap", true) == false) { return false; }
+        size_t len = prefs.getBytesLength(name);
+        bool loaded = len == stored_size() && prefs.getBytes(name, &stored, stored_size()) == stored_size();
+        prefs.end();
+        if (loaded == false) { return false; }
+
+        const char *error = stored.validate();
+        if (error) {
+            Serial.printf("The stored key map is invalid: %s\n", error);
+            return false;
+        }
+        *this = stored;
+        update_press_times();
+        return true;
+    }
+
+    bool save(const char *name = "map") const
+    {
+        Preferences prefs;
+
+        if (validate()) { return false; }
+        if (prefs.begin("keymap", false) == false) { return false; }
+        bool saved = prefs.putBytes(name, this, stored_size()) == stored_size();
+        prefs.end();
+        return saved;
+    }
+};
+
+// Canon WS-1200H with four FS90 servos.
+// The press times are not filled in, so copy it and call update_press_times().
+// FS90 turns 60 degrees in 0.12 s, so 400 deg/s keeps the servo on the profile.
+static const KeyMap default_keymap = {
+    KEYMAP_VERSION,
+    12,
+    4,
+    {
+        // pin, a angle, b angle, adjust, on time, off time, max speed, max accel, hold time
+        { 22, 11, 10, 9, 150, 150, 400, 20000, 50 },    // A: =, B: +
+        { 19, 16, 17, 9, 150, 150, 400, 20000, 50 },    // A: ., B: 0
+        { 23, 16, 16, 11, 150, 150, 400, 20000, 50 },   // A: 1, B: CA
+        { 33, 10, 10, 8, 150, 150, 400, 20000, 50 },    // A:  , B: -
+    },
+    {
+        { 0, SideA },   // =
+        { 0, SideB },   // +
+        { 3, SideB },   // -
+        { 1, SideA },   // .
+        { 1, SideB },   // 0
+        { 2, SideA },   // 1
+        { 2, SideB },   // CA
+    },
+};
+
+#endif
@@ -0,0 +1,192 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _LED_COMPOSITOR_H_
+#define _LED_COMPOSITOR_H_
+
+#include <FastLED.h>
+
+#define MATRIX_SIZE             25
+// The render task shows the LEDs at most 30 times a second.
+#define LED_FRAME_INTERVAL      33
+
+// from the bottom to the top
+typedef enum
+{
+    LayerUnit,
+    LayerChannel,
+    LayerStatus,
+    NumberOfLayers,
+} LedLayer;
+
+// Composes the layers of the 5x5 matrix into the LED buffer.
+// The layers are drawn from any task and only the render task writes the LED buffer,
+// so FastLED.show() runs at one place and only when a pixel has changed.
+// Pixels are in the order of the patterns in led.h. A pixel which no layer sets is black.
+class LedCompositor
+{
+private:
+    CRGB *_leds = NULL;
+    CRGB _layers[NumberOfLayers][MATRIX_SIZE];
+    // bit i is set if the layer sets the pixel i.
+    uint32_t _masks[NumberOfLayers] = {};
+    // 255 for the full brightness
+    uint8_t _brightness[NumberOfLayers];
+    // pixels changed since the last render
+    uint32_t _dirty = 0;
+    // render() returns true even if no pixel has changed.
+    bool _forced = false;
+    // FastLED.setBrightness() of the render task
+    uint8_t _output_brightness = 255;
+    uint32_t _frames = 0;
+    portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+public:
+
+    void begin(CRGB *leds)
+    {
+        _leds = leds;
+        _dirty = (1UL << MATRIX_SIZE) - 1;
+        memset(_brightness, 255, sizeof(_brightness));
+    }
+
+    uint32_t frames() { return _frames; }
+
+    // Renders all pixels and shows them again.
+    void redraw()
+    {
+        portENTER_CRITICAL(&_lock);
+        _dirty = (1UL << MATRIX_SIZE) - 1;
+        _forced = true;
+        portEXIT_CRITICAL(&_lock);
+    }
+
+    // The render task sets it to FastLED, so that it never changes during FastLED.show().
+    void set_output_brightness(uint8_t brightness)
+    {
+        if (_output_brightness == brightness) { return; }
+        _output_brightness = brightness;
+        redraw();
+    }
+
+    uint8_t output_brightness() { return _output_brightness; }
+
+    void set_pixel(LedLayer layer, int i, CRGB color)
+    {
+        portENTER_CRITICAL(&_lock);
+        if ((_masks[layer] >> i & 1) == 0 || _layers[layer][i] != color) {
+            _layers[layer][i] = color;
+            _masks[layer] |= 1UL << i;
+            _dirty |= 1UL << i;
+        }
+        portEXIT_CRITICAL(&_lock);
+    }
+
+    void clear_pixel(LedLayer layer, int i)
+    {
+        portENTER_CRITICAL(&_lock);
+        if (_masks[layer] >> i & 1) {
+            _masks[layer] &= ~(1UL << i);
+            _dirty |= 1UL << i;
+        }
+        portEXIT_CRITICAL(&_lock);
+    }
+
+    void clear(LedLayer layer)
+    {
+        portENTER_CRITICAL(&_lock);
+        _dirty |= _masks[layer];
+        _masks[layer] = 0;
+        portEXIT_CRITICAL(&_lock);
+    }
+
+    // Dims the layer, e.g. to show the age of the value.
+    void set_brightness(LedLayer layer, uint8_t brightness)
+    {
+        portENTER_CRITICAL(&_lock);
+        if (_brightness[layer] != brightness) {
+            _brightness[layer] = brightness;
+            _dirty |= _masks[layer];
+        }
+        portEXIT_CRITICAL(&_lock);
+    }
+
+    // Sets the layer to a pattern of led.h. R, G and B are the colors and the others are black.
+    void set_pattern(LedLayer layer, const char *pattern)
+    {
+        for (int i = 0; i < MATRIX_SIZE; i++) {
+            switch (pattern[i]) {
+                case 'R':
+                    set_pixel(layer, i, CRGB::Red);
+                    break;
+                case 'G':
+                    set_pixel(layer, i, CRGB::Green);
+                    break;
+                case 'B':
+                    set_pixel(layer, i, CRGB::Blue);
+                    break;
+                default:
+                    set_pixel(layer, i, CRGB::Black);
+                    break;
+            }
+        }
+    }
+
+    // Writes the changed pixels into the LED buffer. Returns true if it needs FastLED.show().
+    // Call it from the render task only.
+    bool render()
+    {
+        portENTER_CRITICAL(&_lock);
+        bool changed = _forced;
+        uint32_t dirty = _dirty;
+        _dirty = 0;
+        _forced = false;
+        for (int i = 0; i < MATRIX_SIZE; i++) {
+            if ((dirty >> i & 1) == 0) { continue; }
+            CRGB color = CRGB::Black;
+            for (int layer = NumberOfLayers - 1; layer >= 0; layer--) {
+                if (_masks[layer] >> i & 1) {
+                    color = _layers[layer][i];
+                    if (_brightness[layer] < 255) {
+                        color.nscale8(_brightness[layer]);
+                    }
+                    break;
+                }
+            }
+            // The matrix is upside down.
+            CRGB *led = &_leds[MATRIX_SIZE - 1 - i];
+            if (*led != color) {
+                *led = color;
+                changed = true;
+            }
+        }
+        portEXIT_CRITICAL(&_lock);
+
+        if (changed) { _frames++; }
+        return changed;
+    }
+};
+
+#endif
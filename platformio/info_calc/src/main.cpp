@@ -29,17 +29,71 @@ SOFTWARE.
 #include <FastLED.h>
 #include <time.h>
 #include <esp_now.h>
+#include <esp_wifi.h>
+#include <protocol.h>
+
 #include "led.h"
+#include "led_compositor.h"
+#include "keymap.h"
 #include "pusher.h"
+#include "actuator.h"
+#include "planner.h"
+#include "channel_table.h"
+#include "scheduler.h"
+#include "filter.h"
+#include "senders.h"
+#include "time_service.h"
 #include "light.h"
+#include "resync.h"
+#include "config_store.h"
+#include "metrics.h"
 #include "env.h"
 
+// Test modes which run without Wi-Fi and ESP-NOW.
+#if defined(TEST_MODE) || defined(TEST_COUNT_UP_DOWN) || defined(TEST_LIGHT_PATTERN) || \
+    defined(TEST_RUNTIME_CONFIG)
+#define OFFLINE_TEST
+#endif
+
+#if defined(TEST_RUNTIME_CONFIG) && !defined(ADMIN_CONTROL)
+#define ADMIN_CONTROL
+#endif
+
+// Tasks. The radio task runs on PRO_CPU with the Wi-Fi stack, and the others on APP_CPU,
+// so pressing keys never delays receiving. loop() is the scheduler and the planner at priority 1.
+#define RADIO_TASK_PRIORITY     5
+#define ACTUATOR_TASK_PRIORITY  4
+#define LIGHT_TASK_PRIORITY     2
+#define LED_TASK_PRIORITY       2
+#define RADIO_TASK_STACK        4096
+#define ACTUATOR_TASK_STACK     3072
+#define LIGHT_TASK_STACK        2048
+#define LED_TASK_STACK          2048
+// frames waiting for the radio task
+#define RADIO_QUEUE_SIZE        16
+#define TASK_REPORT_INTERVAL    (10 * 60 * 1000)
+// METRICS_REPORT broadcasts a metrics frame at this interval for a gateway.
+#define METRICS_INTERVAL        (60 * 1000)
+
 // for LEDs
 #define NUM_LEDS 25
 #define LED_DATA_PIN 27
 #define BRIGHTNESS  50
 
 CRGB leds[NUM_LEDS];
+static LedCompositor led_matrix;
+// It flashes the channel number on the matrix after changing the channel.
+#define CHANNEL_FLASH_TIME      1500
+// The link of the shown channel is shown in the bottom corners.
+// The left one is the RSSI and the right one is the drop rate, green, yellow or red.
+#define HEALTH_RSSI_PIXEL       20
+#define HEALTH_DROP_PIXEL       24
+#define RSSI_GOOD               -67
+#define RSSI_FAIR               -80
+#define DROP_GOOD_PERCENT       2
+#define DROP_FAIR_PERCENT       10
+// The unit fades to this brightness as the value gets old.
+#define STALE_BRIGHTNESS        64
 
 // for ntp server
 
@@ -49,6 +103,7 @@ static const int daylightOffset_sec = 0;
 
 static bool time_available = false;
 static struct tm currentTime;
+static TimeService time_service;
 
 
 #define INVALID_DATA_INTERVAL   1 * 60 * 60 * 1000
@@ -56,9 +111,6 @@ static struct tm currentTime;
 // showing data rounding
 #define ROUNDING_INTERVAL      30 * 1000
 
-static bool rounding = false;
-static unsigned long rounding_at = 0;
-
 // Light pattern
 enum LightPattern {
     LIGHT_OFF,
@@ -75,53 +127,9 @@ enum LightPattern {
 };
 
 
-struct ChannelValue {
-    float value;
-    unsigned long received_at;
-    bool available;
-    char unit[16];
-};
-
-static Pusher pushers[] = {
-    Pusher(22, 11, 10, 9),      // A: =, B: +
-    Pusher(19, 16, 17, 9),      // A: ., B: 0
-    Pusher(23, 16, 16, 11),     // A: 1, B: CA
-    Pusher(33, 10, 10, 8),      // A:  , B: -
-};
-
-static Light light = Light(32, 26, 25);
-
-void move_servos()
-{
-    for (int i = 0; i < 3; i++)
-    {
-        pushers[i].move_next();
-    }
-}
-
 // display time on a calculator.
 class Calculator
 {
-    typedef enum
-    {
-        Unknown,
-        Clear,
-
-        Add1Minute,
-        Add10Minutes,
-
-        Add1Hour,
-        Add10Hours,
-        Add100Hours,
-
-        Sub1Minute,
-        Sub10Minutes,
-
-        Sub1Hour,
-        Sub10Hours,
-        Sub100Hours,
-    } mode;
-
     typedef enum
     {
         UnitUnknown,
@@ -132,27 +140,34 @@ class Calculator
     } unit_type;
 
 private:
-    mode _mode = Unknown;
-    int _value = 0;
-    int _digit_values[4];
+    Planner _planner;
     char *_unit_pattern;
     unit_type _unit = UnitClock;
     LightPattern _light_pattern = LIGHT_NORMAL;
+    // LED matrix to show the unit. NULL if the display doesn't have it.
+    LedCompositor *_matrix = NULL;
 
 public:
 
+    void begin(const KeyMap *keymap, Actuator *actuator, LedCompositor *matrix)
+    {
+        _planner.begin(keymap, actuator);
+        _matrix = matrix;
+    }
+
+    Planner &planner() { return _planner; }
     unit_type unit() { return _unit; }
     LightPattern light_pattern() { return _light_pattern; }
     void set_light_pattern(LightPattern pat) { _light_pattern = pat; }
 
     void set_time(int hour, int minute)
     {
-        if (_mode == Unknown)
+        if (_planner.current_mode() == Planner::Unknown)
         {
             clear_all();
         }
         set_unit("clock");
-        set_value((float)hour + (float)minute / 100.0);
+        set_value(hour * 100 + minute);
     }
 
     void set_channel_value(ChannelValue *channel_value) {
@@ -164,17 +179,12 @@ public:
 
     void clear_all()
     {
-        push_clear_all();
-        push_equal();
-        _mode = Clear;
-        _value = 0;
-        for (int i = 0; i < 4; i++) {
-            _digit_values[i] = 0;
-        }
+        _planner.clear_all();
         _unit_pattern = NULL;
     }
 
     void set_unit(const char *unit) {
+        int value = _planner.value();
         const char *units[] = {
             "clock",
             "timer",
@@ -198,10 +208,10 @@ public:
                         _unit = UnitTimer;
                         break;
                     case 2:
-                        if (_value < 1000) {
+                        if (value < 1000) {
                             pattern = led_cold_temperature;
                         } else
-                        if (_value > 2500) {
+                        if (value > 2500) {
                             pattern = led_hot_temperature;
                         } else {
                             pattern = led_norm_temperature;
@@ -209,10 +219,10 @@ public:
                         _unit = UnitTemperature;
                         break;
                     case 3:
-                        if (_value < 3333) {
+                        if (value < 3333) {
                             pattern = led_low_humidity;
                         } else
-                        if (_value > 6666) {
+                        if (value > 6666) {
                             pattern = led_high_humidity;
                         } else {
                             pattern = led_norm_humidity;
@@ -230,26 +240,8 @@ public:
         if (pattern == _unit_pattern) { return; }
         _unit_pattern = pattern;
         Serial.println(_unit_pattern);
-
-        char *ch = _unit_pattern;
-        // Reverse the order of the set values for an upside-down arrangement.
-        for (int i = NUM_LEDS - 1; i >= 0; i--) {
-            switch (*ch++) {
-                case 'R':
-                    leds[i] = CRGB::Red;
-                    break;
-                case 'G':
-                    leds[i] = CRGB::Green;
-                    break;
-                case 'B':
-                    leds[i] = CRGB::Blue;
-                    break;
-                default:
-                    leds[i] = CRGB::Black;
-                    break;
-            }
-        }
-        FastLED.show();
+        if (_matrix == NULL) { return; }
+        _matrix->set_pattern(LayerUnit, _unit_pattern);
     }
 
 #if defined(TEST_MODE) || defined(TEST_COUNT_UP_DOWN)
@@ -258,446 +250,780 @@ public:
 private:
 #endif
 
-    void push_clear_all()
-    {
-        pushers[2].push_b();
-        Serial.print("C");
-    }
+    void push_clear_all() { _planner.push_clear_all(); }
+    void push_one() { _planner.push_one(); }
+    void push_zero() { _planner.push_zero(); }
+    void push_dot() { _planner.push_dot(); }
+    void push_plus() { _planner.push_plus(); }
+    void push_equal() { _planner.push_equal(); }
+    void push_minus() { _planner.push_minus(); }
 
-    void push_one()
-    {
-        pushers[2].push_a();
-        Serial.print("1");
-    }
+private:
 
-    void push_zero()
-    {
-        pushers[1].push_b();
-        Serial.print("0");
-    }
+#if defined(TEST_MODE) || defined(TEST_COUNT_UP_DOWN)
+public:
+#endif
 
-    void push_dot()
-    {
-        pushers[1].push_a();
-        Serial.print(".");
-    }
+    // v is in hundredths.
+    void set_value(int v) {
+        if (_planner.value() == v && _planner.current_mode() != Planner::Unknown) return;
 
-    void push_plus()
-    {
-        pushers[0].push_b();
-        Serial.print("+");
-    }
+        _planner.set_value(v);
+        int shown = _planner.value();
 
-    void push_equal()
-    {
-        pushers[0].push_a();
-        Serial.print("=");
-    }
+        switch(_unit) {
+        case UnitTimer:
+            if (shown >= 100) {
+                _light_pattern = LIGHT_TIMER;
+            } else
+            if (shown >= 30) {
+                _light_pattern = LIGHT_LESS_ONE_MINITUE;
+            } else
+            if (shown >= 10) {
+                _light_pattern = LIGHT_LESS_THIRTY_SECONDS;
+            } else
+            if (shown >= 5) {
+                _light_pattern = LIGHT_LESS_TEN_SECONDS;
+            } else
+            if (shown > 0) {
+                _light_pattern = LIGHT_LESS_FIVE_SECONDS;
+            } else {
+                _light_pattern = LIGHT_FOUR_FEVER;
+            }
+            break;
 
-    void push_minus()
-    {
-        pushers[3].push_b();
-        Serial.print("-");
+        case UnitClock:
+            if ((shown % 100 == 0) && (currentTime.tm_sec < 2)) {
+                _light_pattern = LIGHT_JUST_HOUR;
+                break;
+            } else {
+                _light_pattern = LIGHT_NORMAL;
+                // 分が00でない場合はdefaultでも判断させるためbreakなし。
+            }
+
+        default:
+            if ((shown < 1000) && (shown % 111 == 0)) {
+                _light_pattern = LIGHT_THREE_FEAVER;
+            } else
+            if (shown % 1111 == 0) {
+                _light_pattern = LIGHT_FOUR_FEVER;
+            } else {
+                _light_pattern = LIGHT_NORMAL;
+            }
+            break;
+        }
     }
+};
 
-private:
+static ChannelTable channels(INVALID_DATA_INTERVAL);
+static ChannelFilter channel_filter;
+// The parameters which an admin publisher can change with control frames.
+static ConfigStore config_store;
 
-    void add_ten_minutes(int times)
-    {
-        if (times == 0)
-        {
-            return;
-        }
-        if (_mode != Add10Minutes)
-        {
-            push_plus();
-            push_dot();
-            push_one();
-            _mode = Add10Minutes;
-        }
-        for (int i = 0; i < times; i++)
-        {
-            push_equal();
-            _value += 10;
+static uint32_t rounding_interval() { return config_store.config()->rounding_interval; }
+
+static esp_now_peer_info_t espnow_slave;
+static bool espnow_setuped = false;
+
+#ifdef SECURE_ESPNOW
+#define NUMBER_OF_PEERS         (sizeof(espnow_peers) / sizeof(espnow_peers[0]))
+#endif
+
+static SenderTable senders;
+static uint32_t ack_seq = 0;
+
+// frames which are dropped before parsing.
+static uint32_t rejected_frames = 0;
+// frames which the receive callback drops. Only the callback counts it.
+static volatile uint32_t junk_frames = 0;
+
+// A frame from the receive callback to the radio task.
+struct RadioFrame {
+    uint8_t mac[6];
+    uint8_t len;
+    // dBm, or 0 if unknown
+    int8_t rssi;
+    int64_t received_at;
+    uint8_t data[ESP_NOW_MAX_DATA_LEN];
+};
+
+// The receive callback doesn't tell the RSSI, so it's taken from the same frame in the promiscuous mode.
+static volatile int8_t sniffed_rssi = 0;
+static uint8_t sniffed_mac[6];
+
+static QueueHandle_t radio_queue = NULL;
+// frames which came while the queue is full.
+static uint32_t dropped_frames = 0;
+// The radio task and loop() share the channels, the senders and the displays with it.
+static SemaphoreHandle_t state_lock = NULL;
+
+static TaskHandle_t radio_task_handle = NULL;
+static TaskHandle_t actuator_task_handle = NULL;
+static TaskHandle_t led_task_handle = NULL;
+
+// A display shows all channels in rotation.
+#define ROUND_ALL_CHANNELS      -1
+
+struct DisplayConfig {
+    // pins of the light
+    int b_pin;
+    int r_pin;
+    int g_pin;
+    // true if the LED matrix shows the unit of this display.
+    bool has_leds;
+    // the channel to show, or ROUND_ALL_CHANNELS.
+    int channel;
+    RotationOrder rotation;
+    const KeyMap *keymap;
+    // the ADC1 pin of the servo current, or NO_PRESS_SENSE.
+    int sense_pin;
+};
+
+// A calculator with its pushers and lights.
+class Display
+{
+private:
+    const DisplayConfig *_config = NULL;
+    KeyMap _keymap;
+    // the key map before the servo timings of the runtime config.
+    KeyMap _base_keymap;
+    // The new timings wait until the pushers are idle.
+    bool _timings_pending = false;
+    // resync_cost() of the value, so that it isn't searched again on every loop while it's due.
+    int _resync_cost_of = 0;
+    uint32_t _resync_cost = 0;
+    bool _resync_cost_valid = false;
+    PressSensor _sensor;
+    Actuator _actuator;
+    Calculator _calc;
+    Scheduler _scheduler;
+    ResyncScheduler _resync;
+    Light _light = Light(0, 0, 0);
+    int _current_channel = 0;
+    bool _rounding = false;
+    unsigned long _rounding_at = 0;
+    unsigned long _last_received_at = 0;
+    LedCompositor *_matrix = NULL;
+    // 0 while the channel number isn't shown.
+    unsigned long _channel_flash_at = 0;
+
+    // Lights as many dots as the channel number over the unit.
+    void flash_channel(int ch) {
+        if (_matrix == NULL) { return; }
+        _matrix->clear(LayerChannel);
+        if (ch == 0) { return; }
+        for (int i = 0; i < min(ch, MATRIX_SIZE); i++) {
+            _matrix->set_pixel(LayerChannel, i, CRGB::White);
         }
+        _channel_flash_at = max(millis(), 1UL);
     }
 
-    void sub_ten_minutes(int times)
-    {
-        if (times == 0)
-        {
-            return;
-        }
-        if (_mode != Sub10Minutes)
-        {
-            push_minus();
-            push_dot();
-            push_one();
-            _mode = Sub10Minutes;
-        }
-        for (int i = 0; i < times; i++)
-        {
-            push_equal();
-            _value -= 10;
-        }
+    static CRGB health_color(int level) {
+        return level == 0 ? CRGB::Green : level == 1 ? CRGB::Yellow : CRGB::Red;
     }
 
-    void add_one_minute(int times)
-    {
-        if (times == 0)
-        {
+    // Shows the age, the RSSI and the drop rate of the shown channel.
+    // The levels change seldom, so the matrix is rendered only when they change.
+    void show_health(unsigned long now) {
+        if (_matrix == NULL) { return; }
+        if (_current_channel == 0 || channels.available(_current_channel) == false) {
+            _matrix->set_brightness(LayerUnit, 255);
+            _matrix->clear_pixel(LayerStatus, HEALTH_RSSI_PIXEL);
+            _matrix->clear_pixel(LayerStatus, HEALTH_DROP_PIXEL);
             return;
         }
-        if (_mode != Add1Minute)
-        {
-            push_plus();
-            push_dot();
-            push_zero();
-            push_one();
-            _mode = Add1Minute;
+
+        ChannelValue *value = channels.get(_current_channel);
+        uint32_t age = min(now - value->received_at, channels.interval());
+        // in 16 steps
+        uint32_t fade = (255 - STALE_BRIGHTNESS) * (age / 1000) / (channels.interval() / 1000);
+        _matrix->set_brightness(LayerUnit, 255 - (fade & ~0xf));
+
+        if (value->rssi == 0) {
+            _matrix->clear_pixel(LayerStatus, HEALTH_RSSI_PIXEL);
+        } else {
+            int level = value->rssi >= RSSI_GOOD ? 0 : value->rssi >= RSSI_FAIR ? 1 : 2;
+            _matrix->set_pixel(LayerStatus, HEALTH_RSSI_PIXEL, health_color(level));
         }
-        for (int i = 0; i < times; i++)
-        {
-            push_equal();
-            _value += 1;
+        int drop = channels.drop_percent(_current_channel);
+        if (drop < 0) {
+            _matrix->clear_pixel(LayerStatus, HEALTH_DROP_PIXEL);
+        } else {
+            int level = drop < DROP_GOOD_PERCENT ? 0 : drop < DROP_FAIR_PERCENT ? 1 : 2;
+            _matrix->set_pixel(LayerStatus, HEALTH_DROP_PIXEL, health_color(level));
         }
     }
 
-    void sub_one_minute(int times)
-    {
-        if (times == 0)
-        {
-            return;
-        }
-        if (_mode != Sub1Minute)
-        {
-            push_minus();
-            push_dot();
-            push_zero();
-            push_one();
-            _mode = Sub1Minute;
-        }
-        for (int i = 0; i < times; i++)
-        {
-            push_equal();
-            _value -= 1;
+    void set_rounding(bool f, bool update = false) {
+        if (update == false && _rounding == f) { return; }
+
+        _rounding = f;
+        if (update) {
+            _rounding_at = millis();
+        } else {
+            // for rounding immediately
+            _rounding_at = millis() - rounding_interval();
         }
     }
 
-    void add_hundred_hours(int times)
-    {
-        if (times == 0)
-        {
-            return;
-        }
-        if (_mode != Add100Hours)
-        {
-            push_plus();
-            push_one();
-            push_zero();
-            push_zero();
-            _mode = Add100Hours;
-        }
-        for (int i = 0; i < times; i++)
-        {
-            push_equal();
-            _value += 10000;
+    // The value of the channel in hundredths.
+    int target_of(int ch) {
+        if (ch == 0) {
+            return currentTime.tm_hour * 100 + currentTime.tm_min;
         }
+        return channels.get(ch)->value;
     }
 
-    void sub_hundred_hours(int times)
-    {
-        if (times == 0)
-        {
-            return;
-        }
-        if (_mode != Sub100Hours)
-        {
-            push_minus();
-            push_one();
-            push_zero();
-            push_zero();
-            _mode = Sub100Hours;
+    // Time in ms until the display is expected to show another value.
+    uint32_t idle_window(unsigned long now) {
+        // A timer changes every second.
+        if (_current_channel != 0 && strcmp(channels.get(_current_channel)->unit, "timer") == 0) { return 0; }
+
+        uint32_t window = rounding_interval();
+        if (_current_channel == 0 || channels.available(_current_channel) == false) {
+            window = (60 - currentTime.tm_sec) * 1000;
         }
-        for (int i = 0; i < times; i++)
-        {
-            push_equal();
-            _value -= 10000;
+        if (_rounding) {
+            window = min(window, (uint32_t)(rounding_interval() - min(now - _rounding_at, (unsigned long)rounding_interval())));
         }
+        return window;
     }
 
-    void add_ten_hours(int times)
-    {
-        if (times == 0)
-        {
-            return;
-        }
-        if (_mode != Add10Hours)
-        {
-            push_plus();
-            push_one();
-            push_zero();
-            _mode = Add10Hours;
-        }
-        for (int i = 0; i < times; i++)
-        {
-            push_equal();
-            _value += 1000;
+    // Clears the calculator and enters the value again while nothing else is shown.
+    void resync_if_needed(unsigned long now) {
+        if (_actuator.busy()) { return; }
+        // The cost is a search, so it waits until a resync is due.
+        if (_resync.due(now, _actuator.pressed_count()) == false) { return; }
+
+        Planner &planner = _calc.planner();
+        if (_resync_cost_valid == false || _resync_cost_of != planner.value()) {
+            _resync_cost_of = planner.value();
+            _resync_cost = planner.resync_cost(_resync_cost_of);
+            _resync_cost_valid = true;
         }
+        uint32_t cost = _resync_cost;
+        if (_resync.should_resync(now, _actuator.pressed_count(), cost, idle_window(now)) == false) { return; }
+
+        Serial.printf("\nResync: %d again in %u ms\n", planner.value(), cost);
+        _resync.on_resync(now, _actuator.pressed_count());
+        planner.invalidate();
+        show();
     }
 
-    void sub_ten_hours(int times)
-    {
-        if (times == 0)
-        {
-            return;
+    // Applies the servo timings of the runtime config to the key map.
+    void take_timings() {
+        _keymap = _base_keymap;
+        _resync_cost_valid = false;
+        config_store.config()->override_keymap(&_keymap);
+        const char *error = _keymap.validate();
+        if (error) {
+            Serial.printf("The servo timings are not applied: %s\n", error);
+            _keymap = _base_keymap;
         }
-        if (_mode != Sub10Hours)
-        {
-            push_minus();
-            push_one();
-            push_zero();
-            _mode = Sub10Hours;
-        }
-        for (int i = 0; i < times; i++)
-        {
-            push_equal();
-            _value -= 1000;
+        _keymap.update_press_times();
+        _scheduler.invalidate_costs();
+    }
+
+    bool change_channel(int ch) {
+        if (_current_channel == ch) { return false; }
+
+        _current_channel = ch;
+        Serial.printf("The current channel is %d\n", _current_channel);
+        flash_channel(ch);
+        // Quit the rounding mode if channel no is return to zero.
+        if (_current_channel == 0) {
+            set_rounding(false);
         }
+        return true;
     }
 
-    void add_one_hour(int times)
-    {
-        if (times == 0)
-        {
-            return;
+public:
+
+    Calculator &calc() { return _calc; }
+    const KeyMap *keymap() { return &_keymap; }
+    Actuator &actuator() { return _actuator; }
+    ResyncScheduler &resync() { return _resync; }
+    Scheduler &scheduler() { return _scheduler; }
+    Light &light() { return _light; }
+    int current_channel() { return _current_channel; }
+
+    void begin(const DisplayConfig *config, int index, LedCompositor *matrix) {
+        char name[8];
+
+        _config = config;
+        _keymap = *config->keymap;
+#ifdef KEYMAP_STORE
+        // Keep the compiled key map in NVS, so that later builds use it on this unit.
+        snprintf(name, sizeof(name), "map%d", index);
+        if (_keymap.save(name)) {
+            Serial.printf("The key map %s is stored to NVS.\n", name);
         }
-        if (_mode != Add1Hour)
-        {
-            push_plus();
-            push_one();
-            _mode = Add1Hour;
+#endif
+        snprintf(name, sizeof(name), "map%d", index);
+        if (_keymap.load(name)) {
+            Serial.printf("The key map %s is loaded from NVS.\n", name);
         }
-        for (int i = 0; i < times; i++)
-        {
-            push_equal();
-            _value += 100;
+        _base_keymap = _keymap;
+        take_timings();
+
+        _light = Light(config->b_pin, config->r_pin, config->g_pin);
+        _sensor.begin(config->sense_pin);
+        _actuator.begin(&_keymap, &_sensor);
+        _matrix = config->has_leds ? matrix : NULL;
+        _calc.begin(&_keymap, &_actuator, _matrix);
+        _scheduler.begin(&channels, config->rotation);
+        if (_config->channel != ROUND_ALL_CHANNELS) {
+            _current_channel = _config->channel;
         }
+        set_rounding(false);
+        _resync.begin(_sensor.enabled() ? RESYNC_VERIFIED_INTERVAL : RESYNC_INTERVAL, millis());
     }
 
-    void sub_one_hour(int times)
-    {
-        if (times == 0)
-        {
-            return;
-        }
-        if (_mode != Sub1Hour)
-        {
-            push_minus();
-            push_one();
-            _mode = Sub1Hour;
-        }
-        for (int i = 0; i < times; i++)
-        {
-            push_equal();
-            _value -= 100;
+    // It's called from the radio task with state_lock.
+    void on_receive(int ch, bool timer, bool changed) {
+        if (_config->channel != ROUND_ALL_CHANNELS) { return; }
+
+        _scheduler.on_receive(ch, changed);
+        // タイマーの場合は継続して表示させるためラウンデングモードにせず直ぐにチャンネルを変更する。
+        if (timer) {
+            _current_channel = ch;
         }
-   }
+        set_rounding(timer == false);
+        _last_received_at = millis();
+    }
 
-    void set_digit(int number, int digit) {
-        if (number == 0) { return; }
+    // It's called with state_lock after the runtime config has changed.
+    void on_config() {
+        _timings_pending = true;
+    }
 
-        bool sign = number >= 0;
-        number = abs(number);
-        if (number > 5) {
-            number = 10 - number;
-            sign = !sign;
+    // A long press. The user saw the calculator off, or wants to start again.
+    void reset() {
+        _resync.on_drift(true, millis(), _actuator.pressed_count());
+        if (_config->channel == ROUND_ALL_CHANNELS) {
+            _current_channel = 0;
         }
+        _calc.clear_all();
+        show();
+    }
 
-        switch (digit) {
-            case 0:
-                {
-                    if (sign) {
-                        add_one_minute(number);
-                    } else {
-                        sub_one_minute(number);
-                    }
-                }
-                break;
-            case 1:
-                {
-                    if (sign) {
-                        add_ten_minutes(number);
-                    } else {
-                        sub_ten_minutes(number);
-                   }
-                }
-                break;
+    // The actuator task presses the keys.
+    void update(unsigned long now, bool advance) {
+        if (_actuator.lost()) {
+            Serial.println("\nA press was not confirmed. The calculator is cleared.");
+            _resync.on_drift(false, now, _actuator.pressed_count());
+            _calc.planner().invalidate();
+        }
+        if (_timings_pending && _actuator.busy() == false) {
+            // The planner reads the key map, so the costs follow the new timings too.
+            _timings_pending = false;
+            take_timings();
+            _actuator.reconfigure();
+        }
+        if (_channel_flash_at && now - _channel_flash_at >= CHANNEL_FLASH_TIME) {
+            _matrix->clear(LayerChannel);
+            _channel_flash_at = 0;
+        }
 
-            case 2:
-                {
-                    if (sign) {
-                        add_one_hour(number);
-                    } else {
-                        sub_one_hour(number);
-                    }
-                }
-                break;
-            case 3:
-                {
-                    if (sign) {
-                        add_ten_hours(number);
-                    } else {
-                        sub_ten_hours(number);
+        if (_config->channel == ROUND_ALL_CHANNELS) {
+            bool needs_to_change_current_channel = channels.available(_current_channel) == false;
+
+            // ラウンディングモード時はROUNDING_INTERVAL経過で次のチャンネルを表示する。
+            if (_rounding) {
+                if (_scheduler.dwell_elapsed(now)) {
+                    int ch = _scheduler.changed_channel();
+                    if (ch >= 0) {
+                        change_channel(ch);
+                        set_rounding(true, true);
+                    } else
+                    if (now - _rounding_at >= rounding_interval()) {
+                        needs_to_change_current_channel = true;
+                        set_rounding(true, true);
                     }
                 }
-                break;
-            case 4:
-                {
-                    if (sign) {
-                        add_hundred_hours(number);
-                    } else {
-                        sub_hundred_hours(number);
+            } else {
+                if (_current_channel != 0) {
+                    // 最後の受信からROUNDING_INTERVAL経過したらラウンディングモードに戻す。
+                    if (now - _last_received_at >= rounding_interval()) {
+                        // タイマーの場合は終了しているので無効にする。
+                        if (strcmp(channels.get(_current_channel)->unit, "timer") == 0) {
+                            channels.invalidate(_current_channel);
+                        }
+                        needs_to_change_current_channel = true;
+                        set_rounding(true, true);
                     }
                 }
-                break;
-            defualt:
-                return;
+            }
+
+            if (advance) {
+                change_channel(channels.next_available(_current_channel));
+            } else
+            if (needs_to_change_current_channel) {
+                // Prefer the channel which is cheaper to walk to.
+                change_channel(_scheduler.pick(now, &_calc.planner(), [this](int ch) { return target_of(ch); }));
+            } else
+            if (_rounding && _actuator.busy() == false) {
+                // Spread the costs of the next pick over the dwell.
+                _scheduler.refresh_costs(&_calc.planner(), [this](int ch) { return target_of(ch); });
+            }
         }
+
+        show();
+        show_health(now);
+        resync_if_needed(now);
     }
 
-#if defined(TEST_MODE) || defined(TEST_COUNT_UP_DOWN)
-public:
+    void show() {
+        // Plan the next value after the current sequence is done,
+        // so that the display follows the latest value without piling up keys.
+        if (_actuator.busy()) { return; }
+
+        if (_current_channel == 0 || channels.available(_current_channel) == false) {
+            _calc.set_time(currentTime.tm_hour, currentTime.tm_min);
+        } else {
+            _calc.set_channel_value(channels.get(_current_channel));
+        }
+        _scheduler.on_shown(_current_channel, millis());
+    }
+};
+
+// Add more entries to drive several calculators from one receiver.
+#define NUMBER_OF_DISPLAYS      1
+
+static const DisplayConfig display_configs[NUMBER_OF_DISPLAYS] = {
+    // b, r, g pins, LED matrix, channel, rotation order, key map, press sense pin
+    { 32, 26, 25, true, ROUND_ALL_CHANNELS, RotationByScore, &default_keymap, NO_PRESS_SENSE },
+};
+
+static Display displays[NUMBER_OF_DISPLAYS];
+static TaskHandle_t light_task_handles[NUMBER_OF_DISPLAYS];
+
+// Hands the runtime config to the channels, the LEDs and the displays.
+// It's called with state_lock, so loop() sees the whole change at once.
+static void apply_runtime_config()
+{
+    const RuntimeConfig *config = config_store.config();
+
+    channels.set_interval(config->invalid_data_interval);
+    memcpy(channel_policies, config->policies, sizeof(channel_policies));
+    led_matrix.set_output_brightness(config->brightness);
+    for (int i = 0; i < NUMBER_OF_DISPLAYS; i++) {
+        displays[i].on_config();
+    }
+}
+
+static void begin_runtime_config()
+{
+    // It's too large for the stack.
+    static RuntimeConfig defaults;
+
+    // A control frame names the active revision, so 0 never matches.
+    defaults.revision = 1;
+    defaults.rounding_interval = ROUNDING_INTERVAL;
+    defaults.invalid_data_interval = INVALID_DATA_INTERVAL;
+    defaults.brightness = BRIGHTNESS;
+    defaults.max_speed = defaults.max_accel = defaults.hold_time = 0;
+    memcpy(defaults.policies, channel_policies, sizeof(defaults.policies));
+    config_store.begin(&defaults);
+    apply_runtime_config();
+}
+
+static void update_time()
+{
+    if (!time_service.get_local_time(&currentTime))
+    {
+        Serial.println("Failed to obtain time");
+        return;
+    }
+    if (time_available == false) {
+        led_matrix.clear_pixel(LayerStatus, 0);
+    }
+    time_available = true;
+    Serial.println(&currentTime, "%Y %m %d %a %H:%M:%S");
+}
+
+// accept_frame() returns it for a retransmit of an applied frame.
+#define FRAME_DUPLICATE         -2
+
+// Checks the magic, the type and the paired sender without the tag.
+// The receive callback calls it, so that junk frames don't fill the queue of the radio task.
+// Paired peers never change after setup, so it reads them without state_lock.
+static bool frame_wanted(const uint8_t *mac_addr, const uint8_t *data, int data_len)
+{
+    FrameHeader header;
+
+    if (data_len < 1) { return false; }
+    if (data[0] != FRAME_MAGIC) {
+#ifdef SECURE_ESPNOW
+        return false;
+#else
+        // a text frame from an old publisher
+        return true;
+#endif
+    }
+
+    if (frame_peek(data, data_len, &header) == false) { return false; }
+    switch (header.type) {
+    case FrameValue:
+    case FrameTime:
+        break;
+#ifdef ADMIN_CONTROL
+    case FrameControl:
+        break;
 #endif
+    default:
+        return false;
+    }
+    return senders.paired_only() == false || senders.find(mac_addr) != NULL;
+}
 
-    void set_value(float value) {
-        int v = (value * 100 + 0.5);
-        if (_value == v) return;
+// Checks the sender, the sequence number and the tag before parsing,
+// so that junk frames don't take time from the servos.
+// Returns the length of the payload, FRAME_DUPLICATE or -1.
+static int accept_frame(const uint8_t *mac_addr, const uint8_t *data, int data_len, uint8_t *type, const uint8_t **payload, Sender **sender)
+{
+    FrameHeader header;
+    const uint8_t *key;
+    Sender *peer;
+
+    *sender = NULL;
+    if (frame_wanted(mac_addr, data, data_len) == false) { return -1; }
+    if (data[0] != FRAME_MAGIC) {
+        // a text frame from an old publisher
+        *type = FrameValue;
+        *payload = data;
+        return data_len;
+    }
 
-Serial.printf("set_value %.2f -> \t", value);
+    frame_peek(data, data_len, &header);
+    peer = senders.find(mac_addr);
+    if (peer == NULL && senders.paired_only()) { return -1; }
 
-        int base = 1;
+    key = peer ? peer->key : frame_open_key;
+#ifdef ADMIN_CONTROL
+    // Only the admin knows the key, whoever sends it.
+    if (header.type == FrameControl) {
+        key = admin_key;
+    }
+#endif
+    if (peer && peer->window.check(header.seq) == false) {
+        // The ack of the frame was lost, so the sender sent it again.
+        // It's acknowledged again, but the window keeps it from being applied twice.
+        if (header.type != FrameValue || frame_verify(data, data_len, key, payload) < 0) { return -1; }
+        peer->ack_seq = peer->window.highest();
+        peer->ack_pending = true;
+        return FRAME_DUPLICATE;
+    }
+    int len = frame_verify(data, data_len, key, payload);
+    if (len < 0) { return -1; }
+    // A new sender takes a slot only now, so that junk frames never push out a publisher.
+    if (peer == NULL) {
+        peer = senders.claim(mac_addr);
+    }
+    int32_t ahead = peer->window.started() ? (int32_t)(header.seq - peer->window.highest()) : 1;
+    peer->window.accept(header.seq);
+    peer->gap = ahead > 1 && ahead <= MAX_COUNTED_GAP ? ahead - 1 : 0;
+    *type = header.type;
+    *sender = peer;
+    return len;
+}
 
-        for (int digit = 0; digit < 5; digit++) {
-            if (_value == v) break;
-            int n = v - _value;
-            n = (n / base) % 10;
-            set_digit(n, digit);
-            base *= 10;
-        }
-Serial.printf("\t-> _value %d, v: %d\n", _value, v);
+// Sends a frame back to a sender. It's called from the radio task, not from the receive callback.
+static void send_to(const uint8_t *mac, uint8_t type, const void *payload, size_t payload_len, const uint8_t *key)
+{
+    if (esp_now_is_peer_exist(mac) == false) {
+        // A paired peer is always there, so this one isn't encrypted.
+        esp_now_peer_info_t peer;
+        memset(&peer, 0, sizeof(peer));
+        memcpy(peer.peer_addr, mac, 6);
+        if (esp_now_add_peer(&peer) != ESP_OK) { return; }
+    }
 
-Serial.printf("unit %d\n", _unit);
-        switch(_unit) {
-        case UnitTimer:
-            if (_value >= 100) {
-                _light_pattern = LIGHT_TIMER;
-            } else
-            if (_value >= 30) {
-                _light_pattern = LIGHT_LESS_ONE_MINITUE;
-            } else
-            if (_value >= 10) {
-                _light_pattern = LIGHT_LESS_THIRTY_SECONDS;
-            } else
-            if (_value >= 5) {
-                _light_pattern = LIGHT_LESS_TEN_SECONDS;
-            } else
-            if (_value > 0) {
-                _light_pattern = LIGHT_LESS_FIVE_SECONDS;
-            } else {
-                _light_pattern = LIGHT_FOUR_FEVER;
-            }
-            break;
+    uint8_t frame[MAX_FRAME_LEN];
+    size_t len = frame_seal(frame, sizeof(frame), type, ack_seq++, payload, payload_len, key);
+    esp_now_send(mac, frame, len);
+}
 
-        case UnitClock:
-            if ((_value % 100 == 0) && (currentTime.tm_sec < 2)) {
-                _light_pattern = LIGHT_JUST_HOUR;
-                break;
-            } else {
-                _light_pattern = LIGHT_NORMAL;
-                // 分が00でない場合はdefaultでも判断させるためbreakなし。
-            }
+// Acknowledges the applied frames.
+static void send_acks()
+{
+    for (int i = 0; i < MAX_SENDERS; i++) {
+        Sender *sender = senders.at(i);
+        if (sender->used == false || sender->ack_pending == false) { continue; }
+        sender->ack_pending = false;
 
-        default:
-            if ((_value < 1000) && (_value % 111 == 0)) {
-                _light_pattern = LIGHT_THREE_FEAVER;
-            } else
-            if (_value % 1111 == 0) {
-                _light_pattern = LIGHT_FOUR_FEVER;
-            } else {
-                _light_pattern = LIGHT_NORMAL;
-            }
-            break;
-        }
+        AckPayload ack = { sender->ack_seq };
+        send_to(sender->mac, FrameAck, &ack, sizeof(ack), sender->key);
     }
+}
+
+#ifdef ADMIN_CONTROL
+static const char *control_status_names[] = { "applied", "stale", "invalid", "not stored" };
+
+// A change with CONTROL_PERSIST. The radio task stores it after state_lock is released.
+struct PersistingControl {
+    bool pending;
+    uint8_t mac[6];
+    ControlReply reply;
+    RuntimeConfig config;
 };
+static PersistingControl persisting_control;
 
-static Calculator calc = Calculator();
+static void reply_control(const uint8_t *mac, const ControlReply *reply)
+{
+    Serial.printf("control %u: %s, revision %u\n", reply->seq, control_status_names[reply->status], reply->revision);
+    if (espnow_setuped) {
+        send_to(mac, FrameControlReply, reply, sizeof(*reply), admin_key);
+    }
+}
 
-#define NUMBER_OF_CHANNEL       11
+// Applies a control frame as a whole and replies the result to the admin.
+static void handle_control(const RadioFrame *frame, const uint8_t *data, int data_len)
+{
+    FrameHeader header;
+    ControlHeader control;
 
-static int current_channel = 0;
-static struct ChannelValue channel_values[NUMBER_OF_CHANNEL];
-static unsigned long last_received_at = 0;
+    frame_peek(frame->data, frame->len, &header);
+    if (control_item_count(data, data_len, &control) < 0) {
+        rejected_frames++;
+        return;
+    }
 
-static esp_now_peer_info_t espnow_slave;
-static bool espnow_setuped = false;
+    ControlReply reply = config_store.apply(&control, (const ControlItem *)(data + sizeof(control)));
+    reply.seq = header.seq;
+    if (reply.status == ControlApplied) {
+        apply_runtime_config();
+        if (control.flags & CONTROL_PERSIST) {
+            // The reply waits until the config is stored.
+            persisting_control.pending = true;
+            memcpy(persisting_control.mac, frame->mac, 6);
+            persisting_control.reply = reply;
+            persisting_control.config = *config_store.config();
+            return;
+        }
+    }
+    reply_control(frame->mac, &reply);
+}
 
-static void set_rounding(bool f, bool update = false) {
-    if (update == false && rounding == f) { return; }
-    
-    rounding = f;
-    if (update) {
-        rounding_at = millis();
-    } else {
-        // for rounding immediately
-        rounding_at = millis() - ROUNDING_INTERVAL;
+// Stores the config of the last control frame. It's called from the radio task without state_lock,
+// so writing the flash doesn't stall loop().
+static void persist_control()
+{
+    if (persisting_control.pending == false) { return; }
+    persisting_control.pending = false;
+    if (ConfigStore::save(&persisting_control.config) == false) {
+        persisting_control.reply.status = ControlNotStored;
     }
+
+    xSemaphoreTake(state_lock, portMAX_DELAY);
+    reply_control(persisting_control.mac, &persisting_control.reply);
+    xSemaphoreGive(state_lock);
 }
+#endif
 
-static void update_time()
+// ESP-NOW frames are action frames. It runs in the Wi-Fi task just before the receive callback.
+static void espnow_on_sniff(void *buf, wifi_promiscuous_pkt_type_t type)
 {
-    if (!getLocalTime(&currentTime))
-    {
-        Serial.println("Failed to obtain time");
+    if (type != WIFI_PKT_MGMT) { return; }
+    const wifi_promiscuous_pkt_t *packet = (const wifi_promiscuous_pkt_t *)buf;
+    // the source address of the 802.11 header
+    memcpy(sniffed_mac, packet->payload + 10, 6);
+    sniffed_rssi = packet->rx_ctrl.rssi;
+}
+
+// It runs in the Wi-Fi task, so it only hands the frame to the radio task.
+static void espnow_on_data_receive(const uint8_t *mac_addr, const uint8_t *data, int data_len)
+{
+    RadioFrame frame;
+
+    // Take it first for the time beacon.
+    frame.received_at = esp_timer_get_time();
+    if (data_len > ESP_NOW_MAX_DATA_LEN || frame_wanted(mac_addr, data, data_len) == false) {
+        junk_frames++;
         return;
     }
-    time_available = true;
-    Serial.println(&currentTime, "%Y %m %d %a %H:%M:%S");
+    memcpy(frame.mac, mac_addr, 6);
+    frame.rssi = memcmp(sniffed_mac, mac_addr, 6) == 0 ? sniffed_rssi : 0;
+    memcpy(frame.data, data, data_len);
+    frame.len = data_len;
+    if (xQueueSend(radio_queue, &frame, 0) != pdTRUE) {
+        dropped_frames++;
+    }
 }
 
-static void espnow_on_data_receive(const uint8_t *mac_addr, const uint8_t *data, int data_len)
+// Applies a frame to the channels. It's called from the radio task with state_lock.
+static void handle_frame(const RadioFrame *frame)
 {
-    ushort ch = 0;
-    float value = 0.0f;
-    char unit[16] = { 0 };
-    char buff[64] = { 0 };
-    ChannelValue *channel_value;
-
-    strncpy(buff, (const char *)data, min(data_len, 63));
-    
-    sscanf(buff, "%hd,%f,%s\n", &ch, &value, unit);
-    if (ch < 1 || ch >= NUMBER_OF_CHANNEL) {
+    int64_t received_at = frame->received_at;
+    int frame_len = frame->len;
+    const uint8_t *data;
+    int data_len;
+    uint8_t type;
+    Sender *sender;
+
+    data_len = accept_frame(frame->mac, frame->data, frame->len, &type, &data, &sender);
+    if (data_len == FRAME_DUPLICATE) { return; }
+    if (data_len < 0) {
+        rejected_frames++;
+        return;
+    }
+
+    if (type == FrameTime) {
+        if (data_len != sizeof(TimePayload)) { return; }
+        TimePayload beacon;
+        memcpy(&beacon, data, sizeof(beacon));
+        // The beacon stamped it before sending, so the frame was on the air since then.
+        int64_t epoch_us = beacon.epoch_us + frame_airtime_us(frame_len);
+        TimeService::post_sample(epoch_us, received_at, beacon.error_ms * 1000LL);
+        return;
+    }
+#ifdef ADMIN_CONTROL
+    if (type == FrameControl) {
+        handle_control(frame, data, data_len);
+        return;
+    }
+#endif
+
+    ValuePayload payload;
+    if (parse_value_payload(data, data_len, &payload) == false) {
+        rejected_frames++;
+        return;
+    }
+    int ch = payload.ch;
+    int32_t value = payload.value;
+    const char *unit = payload.unit;
+
+    if (channels.valid_channel(ch) == false) {
         Serial.printf("The channell is %d. ", ch);
-        Serial.println("The channel should 1 to 10.");
+        Serial.printf("The channel should 1 to %d.\n", MAX_CHANNELS - 1);
         return;
     }
 
-    channel_value = &channel_values[ch];
-    channel_value->available = true;
-    channel_value->value = value;
-    channel_value->received_at = millis();
-    strncpy(channel_value->unit, unit, 15);
+    bool timer = strcmp(unit, "timer") == 0;
+    unsigned long now = millis();
+    // A timer counts down every second, so it's shown as it is.
+    if (timer == false) {
+        if (channels.available(ch) == false) {
+            channel_filter.reset(ch);
+        }
+        value = channel_filter.apply(ch, value, now);
+    }
+    bool changed = channels.update(ch, value, unit, now);
+    // Lost frames are counted to the channel of the next frame from the sender.
+    channels.record_link(ch, frame->rssi, sender != NULL, sender ? sender->gap : 0);
+
+    char text[40];
+    format_value_payload(text, sizeof(text), ch, payload.value, unit);
+    Serial.printf("<< %s\n", text);
 
-    Serial.printf("<< %s\n", buff);
+    for (int i = 0; i < NUMBER_OF_DISPLAYS; i++) {
+        displays[i].on_receive(ch, timer, changed);
+    }
 
-    // タイマーの場合は継続して表示させるためラウンデングモードにせず直ぐにチャンネルを変更する。
-    bool rounding = strcmp(unit, "timer") != 0;
-    if (rounding == false) {
-        current_channel = ch;
+    if (sender) {
+        sender->ack_seq = sender->window.highest();
+        sender->ack_pending = true;
     }
-    set_rounding(rounding);
-    last_received_at = millis();
 }
 
 // @refer: https://it-evo.jp/blog/blog-1397/
@@ -720,6 +1046,23 @@ static void espnow_setup_if_needed()
         return;
     }
 
+#ifdef SECURE_ESPNOW
+    // Only paired publishers are accepted and their frames are encrypted.
+    esp_now_set_pmk(espnow_pmk);
+    for (int i = 0; i < NUMBER_OF_PEERS; i++)
+    {
+        senders.pair(&espnow_peers[i]);
+
+        memset(&espnow_slave, 0, sizeof(espnow_slave));
+        memcpy(espnow_slave.peer_addr, espnow_peers[i].mac, 6);
+        memcpy(espnow_slave.lmk, espnow_peers[i].lmk, ESP_NOW_KEY_LEN);
+        espnow_slave.encrypt = true;
+        if (esp_now_add_peer(&espnow_slave) == ESP_OK)
+        {
+            Serial.println("Pair success");
+        }
+    }
+#else
     memset(&espnow_slave, 0, sizeof(espnow_slave));
     for (int i = 0; i < 6; ++i)
     {
@@ -731,12 +1074,159 @@ static void espnow_setup_if_needed()
     {
         Serial.println("Pair success");
     }
+#endif
     esp_now_register_recv_cb(espnow_on_data_receive);
-    last_received_at = millis();
+
+    wifi_promiscuous_filter_t filter = { WIFI_PROMIS_FILTER_MASK_MGMT };
+    esp_wifi_set_promiscuous_filter(&filter);
+    esp_wifi_set_promiscuous_rx_cb(espnow_on_sniff);
+    esp_wifi_set_promiscuous(true);
+}
+
+static void radio_task(void *param) {
+    RadioFrame frame;
+
+    while (true)
+    {
+        if (xQueueReceive(radio_queue, &frame, portMAX_DELAY) != pdTRUE) { continue; }
+
+        xSemaphoreTake(state_lock, portMAX_DELAY);
+        handle_frame(&frame);
+        if (espnow_setuped) {
+            send_acks();
+        }
+        xSemaphoreGive(state_lock);
+#ifdef ADMIN_CONTROL
+        persist_control();
+#endif
+    }
+}
+
+// It preempts loop(), so planning never holds a key longer than the key map says.
+static void actuator_task(void *param) {
+    while (true)
+    {
+        for (int i = 0; i < NUMBER_OF_DISPLAYS; i++) {
+            displays[i].actuator().update(millis());
+        }
+        vTaskDelay(1);
+    }
+}
+
+// Shows the LED matrix when a pixel has changed, at most every LED_FRAME_INTERVAL.
+// Only this task calls FastLED.show(), so the RMT transfers don't block the other tasks.
+static void led_task(void *param) {
+    TickType_t woke_at = xTaskGetTickCount();
+
+    while (true)
+    {
+        if (led_matrix.render()) {
+            FastLED.setBrightness(led_matrix.output_brightness());
+            FastLED.show();
+        }
+        vTaskDelayUntil(&woke_at, pdMS_TO_TICKS(LED_FRAME_INTERVAL));
+    }
+}
+
+// Prints the free stack of the tasks, so that the stack sizes can be trimmed, and the press counts.
+static void report_tasks()
+{
+    Serial.printf("tasks: free stack radio %u, actuator %u, led %u, loop %u bytes",
+        uxTaskGetStackHighWaterMark(radio_task_handle), uxTaskGetStackHighWaterMark(actuator_task_handle),
+        uxTaskGetStackHighWaterMark(led_task_handle), uxTaskGetStackHighWaterMark(NULL));
+    for (int i = 0; i < NUMBER_OF_DISPLAYS; i++) {
+        Serial.printf(", light%d %u", i, uxTaskGetStackHighWaterMark(light_task_handles[i]));
+    }
+    Serial.printf(", radio queue %u, dropped %u, junk %u, led frames %u\n", uxQueueMessagesWaiting(radio_queue),
+        dropped_frames, junk_frames, led_matrix.frames());
+    for (int i = 0; i < NUMBER_OF_DISPLAYS; i++) {
+        Actuator &actuator = displays[i].actuator();
+        ResyncScheduler &resync = displays[i].resync();
+        Serial.printf("display%d: presses %u, confirmed %u, retried %u, lost %u\n", i, actuator.pressed_count(),
+            actuator.confirmed_count(), actuator.retried_count(), actuator.lost_count());
+        // The drifts are compared with the press time of the key map.
+        Serial.printf("  resyncs %u, drifts %u (sensed %u, long press %u), %u presses per drift, press %u ms\n",
+            resync.resyncs(), resync.drifts(), resync.lost_drifts(), resync.manual_drifts(),
+            resync.presses_per_drift(), displays[i].keymap()->press_time(KeyEqual));
+    }
+    for (int ch = 1; ch < MAX_CHANNELS; ch++) {
+        if (channels.available(ch) == false) { continue; }
+        ChannelValue *value = channels.get(ch);
+        Serial.printf("ch%d: age %lu s, rssi %d dBm, drop %d%%\n", ch, (millis() - value->received_at) / 1000,
+            value->rssi, channels.drop_percent(ch));
+    }
+}
+
+#ifdef METRICS_REPORT
+static LoopLatency loop_latency;
+
+#ifdef ADMIN_CONTROL
+static const uint8_t *metrics_key = admin_key;
+#else
+static const uint8_t *metrics_key = frame_open_key;
+#endif
+
+// Broadcasts the health of this unit. It's called with state_lock, as the radio task sends with it.
+static void send_metrics(unsigned long now)
+{
+    static const uint8_t broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    static unsigned long sent_at = 0;
+    static uint32_t presses_at = 0;
+    // The channels go around in turn, METRICS_CHANNELS at a time.
+    static int next_channel = 1;
+    MetricsPayload metrics;
+
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.version = METRICS_VERSION;
+    uint32_t interval = max(now - sent_at, 1UL);
+    metrics.uptime_s = esp_timer_get_time() / 1000000;
+    metrics.interval_ms = interval;
+    metrics.config_revision = config_store.revision();
+    loop_latency.take(&metrics);
+
+    uint32_t presses = 0;
+    for (int i = 0; i < NUMBER_OF_DISPLAYS; i++) {
+        presses += displays[i].actuator().pressed_count();
+        metrics.resyncs += displays[i].resync().resyncs();
+        metrics.drifts += displays[i].resync().drifts();
+    }
+    metrics.presses = presses - presses_at;
+    metrics.presses_per_hour = min((uint64_t)(presses - presses_at) * 3600000 / interval, (uint64_t)UINT16_MAX);
+    presses_at = presses;
+    sent_at = now;
+
+    metrics.heap_free = ESP.getFreeHeap();
+    metrics.heap_min = ESP.getMinFreeHeap();
+    metrics.stack_radio = uxTaskGetStackHighWaterMark(radio_task_handle);
+    metrics.stack_actuator = uxTaskGetStackHighWaterMark(actuator_task_handle);
+    metrics.stack_led = uxTaskGetStackHighWaterMark(led_task_handle);
+    metrics.stack_loop = uxTaskGetStackHighWaterMark(NULL);
+    metrics.stack_light = uxTaskGetStackHighWaterMark(light_task_handles[0]);
+    metrics.queue_dropped = dropped_frames;
+    metrics.rejected = rejected_frames + junk_frames;
+
+    int ch = next_channel;
+    for (int i = 1; i < MAX_CHANNELS && metrics.channel_count < METRICS_CHANNELS; i++, ch = ch % (MAX_CHANNELS - 1) + 1) {
+        if (channels.available(ch) == false) { continue; }
+        ChannelValue *value = channels.get(ch);
+        ChannelMetrics *channel = &metrics.channels[metrics.channel_count++];
+        channel->ch = ch;
+        channel->received = value->received;
+        channel->lost = value->lost;
+        channel->rssi = value->rssi;
+        next_channel = ch % (MAX_CHANNELS - 1) + 1;
+    }
+
+    // The channels which aren't used are cut off.
+    size_t len = sizeof(metrics) - (METRICS_CHANNELS - metrics.channel_count) * sizeof(ChannelMetrics);
+    send_to(broadcast, FrameMetrics, &metrics, len, metrics_key);
 }
+#endif
 
-static void light_task(void *) {
-    bool changed;
+static void light_task(void *param) {
+    Display *display = (Display *)param;
+    Calculator &calc = display->calc();
+    Light &light = display->light();
 
     light.begin();
 
@@ -839,15 +1329,6 @@ static void light_task(void *) {
     }
 }
 
-static void display() {
-    if (current_channel == 0) {
-        calc.set_time(currentTime.tm_hour, currentTime.tm_min);
-    } else {
-        calc.set_channel_value(&channel_values[current_channel]);
-    }
-    calc.light_pattern();
-}
-
 void setup()
 {
     auto cfg = M5.config();
@@ -862,55 +1343,53 @@ void setup()
         }
     }
 
-    for (int i = 0; i < NUMBER_OF_CHANNEL; i++) {
-        channel_values[i].available = false;
-        channel_values[i].value = 0.0f;
-        channel_values[i].unit[0] = '\0';
-    }
-    // channel zero is for time.
-    channel_values[0].available = true;
+    init_channel_policies();
+    // before the displays, so that the servo timings of the config go on their key maps.
+    begin_runtime_config();
 
     FastLED.addLeds<NEOPIXEL, LED_DATA_PIN>(leds, NUM_LEDS); // GRB ordering is assumed
-    FastLED.setBrightness(BRIGHTNESS);
 
-    leds[24] = CRGB::Red;
-    FastLED.show();
+    // The red dot is on until the time is set.
+    led_matrix.begin(leds);
+    led_matrix.set_pixel(LayerStatus, 0, CRGB::Red);
+    xTaskCreatePinnedToCore(led_task, "led", LED_TASK_STACK, NULL, LED_TASK_PRIORITY, &led_task_handle, APP_CPU_NUM);
 
-    xTaskCreatePinnedToCore(light_task, "light", 2048, NULL, 25, NULL, APP_CPU_NUM);
-    
     ESP32PWM::allocateTimer(0);
     ESP32PWM::allocateTimer(1);
     ESP32PWM::allocateTimer(2);
     ESP32PWM::allocateTimer(3);
-    for (int i = 0; i < 4; i++)
+    for (int i = 0; i < NUMBER_OF_DISPLAYS; i++)
     {
-        pushers[i].begin();
+        displays[i].begin(&display_configs[i], i, &led_matrix);
+        xTaskCreatePinnedToCore(light_task, "light", LIGHT_TASK_STACK, &displays[i], LIGHT_TASK_PRIORITY,
+                                &light_task_handles[i], APP_CPU_NUM);
     }
 
-#if !defined(TEST_MODE) && !defined(TEST_COUNT_UP_DOWN) && !defined(TEST_LIGHT_PATTERN)
-    WiFi.begin(ssid, password);
-    while (WiFi.status() != WL_CONNECTED)
-    {
-        delay(500);
-        M5.Lcd.print(".");
-    }
-    M5.Lcd.println("\nCONNECTED!");
-
-    leds[24] = CRGB::Green;
-    FastLED.show();
-
-    set_rounding(false);
-
-    configTime(gmtOffset_sec, daylightOffset_sec, ntpServer);
-    // WiFi.disconnect(true);
-    // WiFi.mode(WIFI_OFF);
-    delay(20);
+    state_lock = xSemaphoreCreateMutex();
+    radio_queue = xQueueCreate(RADIO_QUEUE_SIZE, sizeof(RadioFrame));
+    xTaskCreatePinnedToCore(radio_task, "radio", RADIO_TASK_STACK, NULL, RADIO_TASK_PRIORITY,
+                            &radio_task_handle, PRO_CPU_NUM);
+    xTaskCreatePinnedToCore(actuator_task, "actuator", ACTUATOR_TASK_STACK, NULL, ACTUATOR_TASK_PRIORITY,
+                            &actuator_task_handle, APP_CPU_NUM);
+
+#ifndef OFFLINE_TEST
+#ifdef TIME_FROM_BEACON
+    // The time comes from a time beacon of timer_publisher, so it doesn't need a router.
+    time_service.begin(NULL, NULL, gmtOffset_sec, daylightOffset_sec, NULL);
+    espnow_setup_if_needed();
+#else
+    // It connects to Wi-Fi only while syncing the time, so the radio is free for ESP-NOW.
+    time_service.begin(ssid, password, gmtOffset_sec, daylightOffset_sec, ntpServer);
+#endif
 #endif
 }
 
 #ifdef TEST_MODE
 // test servo moving.
 void test_mode() {
+    static int test_state = 0;
+    Calculator &calc = displays[0].calc();
+
     if (M5.BtnA.wasPressed())
     {
         switch (test_state)
@@ -946,55 +1425,421 @@ void test_mode() {
         }
         test_state = (test_state + 1) % 7;
     }
+    displays[0].actuator().flush();
 }
 #endif
 
 #ifdef TEST_COUNT_UP_DOWN
+// value is in hundredths.
+static void test_set_value(int value) {
+    displays[0].calc().set_value(value);
+    displays[0].actuator().flush();
+    delay(1000);
+}
+
 void test_count_up_down() {
     delay(10000);
     Serial.println("test_count_up_down");
 
-    calc.clear_all();
+    displays[0].calc().clear_all();
     for (int i = 0; i < 10; i++) {
-        calc.set_value((float)i * 0.01);
-        delay(1000);
+        test_set_value(i);
     }
     for (int i = 0; i < 10; i++) {
-        calc.set_value((float)i * 0.1);
-        delay(1000);
+        test_set_value(i * 10);
     }
     for (int i = 0; i < 10; i++) {
-        calc.set_value((float)i * 1.0);
-        delay(1000);
+        test_set_value(i * 100);
     }
     for (int i = 0; i < 10; i++) {
-        calc.set_value((float)i * 10.0);
-        delay(1000);
+        test_set_value(i * 1000);
     }
 
-    calc.set_value(0.0);
-    delay(1000);
+    test_set_value(0);
 
     for (int i = 9; i >= 0; i--) {
-        calc.set_value((float)i * 10.0);
-        delay(1000);
+        test_set_value(i * 1000);
     }
     for (int i = 9; i >= 0; i--) {
-        calc.set_value((float)i * 1.0);
-        delay(1000);
+        test_set_value(i * 100);
     }
     for (int i = 9; i >= 0; i--) {
-        calc.set_value((float)i * 0.1);
-        delay(1000);
+        test_set_value(i * 10);
     }
     for (int i = 9; i >= 0; i--) {
-        calc.set_value((float)i * 0.01);
-        delay(1000);
+        test_set_value(i);
     }
 
-    calc.set_value(0.0);
-    delay(1000);
+    test_set_value(0);
+}
+#endif
+
+#ifdef TEST_ROTATION_COST
+#define TEST_ROTATION_CHANNELS  5
+#define TEST_ROTATION_CYCLES    60
+
+// Compares presses per rotation cycle between the index order, the score order and the tour.
+// With the same policy for all channels, the score order takes the cheapest channel not shown in the cycle.
+static void test_rotation_cost() {
+    // clock, temperature, humidity, pressure and CO2 in hundredths.
+    int values[TEST_ROTATION_CHANNELS] = { 1234, 2345, 5610, 1013, 450 };
+    uint16_t chs[TEST_ROTATION_CHANNELS];
+    int targets[TEST_ROTATION_CHANNELS];
+    Planner by_index, by_score, by_tour;
+    RotationTour tour;
+    int tour_ch = 0;
+    int replans = 0;
+    int estimates = 0;
+
+    delay(10000);
+    Serial.println("test_rotation_cost");
+
+    by_index.begin(displays[0].keymap(), NULL);
+    by_score.begin(displays[0].keymap(), NULL);
+    by_tour.begin(displays[0].keymap(), NULL);
+    randomSeed(1);
+
+    for (int cycle = 0; cycle < TEST_ROTATION_CYCLES; cycle++) {
+        // The clock goes a minute and the sensors drift a little.
+        values[0] += values[0] % 100 == 59 ? 41 : 1;
+        for (int i = 1; i < TEST_ROTATION_CHANNELS; i++) {
+            values[i] += random(-10, 11);
+        }
 
+        for (int i = 0; i < TEST_ROTATION_CHANNELS; i++) {
+            by_index.set_value(values[i]);
+        }
+
+        bool shown[TEST_ROTATION_CHANNELS] = { false };
+        for (int i = 0; i < TEST_ROTATION_CHANNELS; i++) {
+            int best = -1;
+            for (int j = 0; j < TEST_ROTATION_CHANNELS; j++) {
+                if (shown[j]) { continue; }
+                if (best < 0 || by_score.estimate(values[j]) < by_score.estimate(values[best])) { best = j; }
+            }
+            shown[best] = true;
+            by_score.set_value(values[best]);
+        }
+
+        // The same picks as Scheduler::pick_in_tour(), as many as the channels.
+        for (int i = 0; i < TEST_ROTATION_CHANNELS; i++) {
+            for (int j = 0; j < TEST_ROTATION_CHANNELS; j++) {
+                chs[j] = (tour_ch + j) % TEST_ROTATION_CHANNELS;
+                targets[j] = values[chs[j]];
+            }
+            if (tour.matches(chs, TEST_ROTATION_CHANNELS) == false) {
+                tour.plan(chs, targets, TEST_ROTATION_CHANNELS, &by_tour);
+                replans++;
+                estimates += tour.estimates();
+            }
+            tour_ch = tour.next(tour_ch);
+            by_tour.set_value(values[tour_ch]);
+        }
+    }
+
+    Serial.printf("presses per cycle: index order %.1f, score order %.1f, tour %.1f (%d replans, %d estimates)\n",
+        (float)by_index.presses() / TEST_ROTATION_CYCLES,
+        (float)by_score.presses() / TEST_ROTATION_CYCLES,
+        (float)by_tour.presses() / TEST_ROTATION_CYCLES,
+        replans, estimates);
+    Serial.printf("ms per cycle: index order %u, score order %u, tour %u\n",
+        by_index.cost() / TEST_ROTATION_CYCLES, by_score.cost() / TEST_ROTATION_CYCLES,
+        by_tour.cost() / TEST_ROTATION_CYCLES);
+}
+#endif
+
+#ifdef TEST_PLANNER_COST
+struct PlannerCase {
+    const char *name;
+    int from;
+    int to;
+};
+
+// in hundredths
+static const PlannerCase planner_cases[] = {
+    { "clock a minute", 1259, 1300 },
+    { "clock an hour", 1234, 1334 },
+    { "temperature to minus", 120, -350 },
+    { "temperature from minus", -1520, 230 },
+    { "humidity", 5610, 4870 },
+    { "power", 123450, 98760 },
+    { "pressure", 101325, 100890 },
+    { "pressure to clock", 101325, 1234 },
+    { "clock to power", 1234, 123450 },
+    { "power to minus", 123450, -123450 },
+    { "large", 999999999, -1 },
+};
+#define NUMBER_OF_PLANNER_CASES (sizeof(planner_cases) / sizeof(planner_cases[0]))
+
+#define TEST_PLANNER_SWITCHES   1000
+
+// Compares the strategies for each transition and shows what set_value() chooses.
+// Then it counts how often each strategy wins while switching between channels at random.
+static void test_planner_cost() {
+    static const char *names[] = { "walk", "clear", "type" };
+    uint32_t walked = 0, chosen_total = 0;
+
+    delay(10000);
+    Serial.println("test_planner_cost: walk ms, clear ms, type ms, chosen");
+
+    for (int i = 0; i < NUMBER_OF_PLANNER_CASES; i++) {
+        const PlannerCase &c = planner_cases[i];
+        Planner planner;
+        planner.begin(displays[0].keymap(), NULL);
+        planner.clear_all();
+        planner.set_value(c.from);
+
+        int typed = 0;
+        uint32_t cost;
+        uint32_t walk = planner.walk_cost(c.to);
+        uint32_t clear = planner.clear_cost(c.to);
+        uint32_t type = planner.type_cost(c.to, &typed);
+        Planner::strategy chosen = planner.choose(c.to, &cost, &typed);
+        Serial.printf("  %-24s %10d -> %10d: %6u %6u %6u (%d) %s\n",
+            c.name, c.from, c.to, walk, clear, type, typed, names[chosen]);
+        walked += walk;
+        chosen_total += cost;
+    }
+    Serial.printf("test_planner_cost: %u ms walking always, %u ms chosen\n", walked, chosen_total);
+
+    Planner planner;
+    planner.begin(displays[0].keymap(), NULL);
+    planner.clear_all();
+    randomSeed(1);
+    for (int i = 0; i < TEST_PLANNER_SWITCHES; i++) {
+        const PlannerCase &c = planner_cases[random(NUMBER_OF_PLANNER_CASES)];
+        planner.set_value(c.to + random(-50, 51));
+    }
+    Serial.printf("test_planner_cost: %d switches, walk %u, clear %u, type %u, %.1f s each\n",
+        TEST_PLANNER_SWITCHES, planner.wins(Planner::WalkFromValue), planner.wins(Planner::ClearAndWalk),
+        planner.wins(Planner::TypeAndWalk), planner.cost() / 1000.0f / TEST_PLANNER_SWITCHES);
+}
+#endif
+
+#ifdef TEST_MOTION_PROFILE
+// Compares the press times of the fixed waits and the motion profile, and prints a press.
+static void test_motion_profile() {
+    KeyMap fixed = *displays[0].keymap();
+    const KeyMap *profiled = displays[0].keymap();
+    for (int i = 0; i < fixed.number_of_pushers; i++) {
+        fixed.pushers[i].max_speed = 0;
+    }
+    fixed.update_press_times();
+
+    delay(10000);
+    Serial.println("test_motion_profile: key, fixed ms, profiled ms");
+    for (int key = 0; key < NumberOfKeys; key++) {
+        Serial.printf("  %c %4u %4u\n", key_chars[key], fixed.press_time((Key)key), profiled->press_time((Key)key));
+    }
+
+    // 12:59 -> 13:00 and 23.45 -> 18.70
+    Planner by_fixed, by_profile;
+    by_fixed.begin(&fixed, NULL);
+    by_profile.begin(profiled, NULL);
+    auto walk = [](Planner *planner, int from, int to) {
+        planner->clear_all();
+        planner->set_value(from);
+        return planner->estimate(to);
+    };
+    Serial.printf("  12:59 -> 13:00 fixed %u ms, profiled %u ms\n", walk(&by_fixed, 1259, 1300), walk(&by_profile, 1259, 1300));
+    Serial.printf("  23.45 -> 18.70 fixed %u ms, profiled %u ms\n", walk(&by_fixed, 2345, 1870), walk(&by_profile, 2345, 1870));
+
+    // the angles of the "1" key every SERVO_UPDATE_INTERVAL
+    const PusherConfig *config = &profiled->pushers[profiled->keys[KeyOne].pusher];
+    PusherSide side = (PusherSide)profiled->keys[KeyOne].side;
+    MotionProfile motion;
+    motion.plan(0, config->side_angle(side), config->max_speed, config->max_accel);
+    Serial.printf("  a press of 1: %.0f ms to the key, %u ms held\n  ", motion.duration(), config->hold_time);
+    for (int t = 0; t <= (int)motion.duration() + SERVO_UPDATE_INTERVAL; t += SERVO_UPDATE_INTERVAL) {
+        Serial.printf("%.1f ", motion.at(t));
+    }
+    Serial.println();
+}
+#endif
+
+#ifdef TEST_NOISY_SENSOR
+// a frame every 5 seconds for an hour
+#define TEST_NOISY_FRAMES       720
+
+// Compares presses per hour of a jittering temperature sensor with and without the filter.
+static void test_noisy_sensor() {
+    Planner raw, filtered;
+    ChannelFilter filter;
+    // 23.45 degrees
+    int32_t temperature = 2345;
+
+    delay(10000);
+    Serial.println("test_noisy_sensor");
+
+    raw.begin(displays[0].keymap(), NULL);
+    filtered.begin(displays[0].keymap(), NULL);
+    raw.set_value(temperature);
+    filtered.set_value(temperature);
+    uint32_t raw_presses = raw.presses();
+    uint32_t filtered_presses = filtered.presses();
+    randomSeed(1);
+
+    for (int i = 0; i < TEST_NOISY_FRAMES; i++) {
+        // It drifts 0.5 degrees in an hour and jitters 0.02 degrees.
+        int32_t value = temperature + 50 * i / TEST_NOISY_FRAMES + random(-2, 3);
+        raw.set_value(value);
+        filtered.set_value(filter.apply(1, value, i * 5000UL));
+    }
+
+    Serial.printf("presses per hour: raw %u, filtered %u\n",
+        raw.presses() - raw_presses, filtered.presses() - filtered_presses);
+}
+#endif
+
+#ifdef TEST_PARSER_FUZZ
+#define TEST_PARSER_CASES       200000
+#define TEST_PARSER_SPEED_RUNS  20000
+
+static const char *parser_seeds[] = {
+    "1,23.450,°C",
+    "3,4.590,timer",
+    "12,-3.500,°C",
+    "255,100.000,%",
+    "7,0.5,",
+    "8,1234.5",
+    "65535,  1.000,hPa\n",
+};
+#define NUMBER_OF_PARSER_SEEDS  (sizeof(parser_seeds) / sizeof(parser_seeds[0]))
+
+// A random valid payload with 0 to 3 decimals, and the value it means in hundredths.
+static int parser_random_payload(char *buf, int cap, ValuePayload *expected) {
+    static const char *units[] = { "°C", "%", "timer", "hPa", "ppm", "" };
+    static const long scales[] = { 1, 10, 100, 1000 };
+    expected->ch = random(0x10000);
+    int decimals = random(4);
+    long magnitude = random(10000000L * scales[decimals]);
+    bool negative = random(2);
+    strcpy(expected->unit, units[random(6)]);
+
+    // rounded half away from zero
+    long value = decimals <= 2 ? magnitude * scales[2 - decimals] : (magnitude + 5) / 10;
+    expected->value = negative ? -value : value;
+
+    long integer = magnitude / scales[decimals];
+    if (decimals == 0) {
+        return snprintf(buf, cap, "%u,%s%ld,%s", expected->ch, negative ? "-" : "", integer, expected->unit);
+    }
+    return snprintf(buf, cap, "%u,%s%ld.%0*ld,%s", expected->ch, negative ? "-" : "", integer,
+                    decimals, magnitude % scales[decimals], expected->unit);
+}
+
+// Changes a few bytes, the length or the whole content.
+static int parser_mutate(uint8_t *buf, int len, int cap) {
+    int changes = random(1, 4);
+    for (int i = 0; i < changes; i++) {
+        switch (random(6)) {
+        case 0:
+            if (len > 0) { buf[random(len)] ^= 1 << random(8); }
+            break;
+        case 1:
+            if (len > 0) { buf[random(len)] = random(256); }
+            break;
+        case 2:
+            if (len < cap) {
+                int at = random(len + 1);
+                memmove(buf + at + 1, buf + at, len - at);
+                buf[at] = "0123456789,.-+ \n"[random(16)];
+                len++;
+            }
+            break;
+        case 3:
+            if (len > 0) {
+                int at = random(len);
+                memmove(buf + at, buf + at + 1, len - at - 1);
+                len--;
+            }
+            break;
+        case 4:
+            len = random(len + 1);
+            break;
+        default:
+            len = random(cap + 1);
+            for (int j = 0; j < len; j++) {
+                buf[j] = random(256);
+            }
+            break;
+        }
+    }
+    return len;
+}
+
+// Runs the receive path before the channel table on valid and broken frames,
+// and compares the speed of parse_value_payload() with sscanf() on the device.
+// An overread doesn't show here. parser_fuzz of host_test runs the parsers under the address sanitizer.
+static void test_parser_fuzz() {
+    uint8_t buf[MAX_FRAME_LEN + 16];
+    const uint8_t mac[6] = { 0x02, 0x46, 0x5a, 0x00, 0x00, 0x01 };
+    uint32_t mismatches = 0, accepted = 0, broken = 0;
+    ValuePayload parsed, expected;
+
+    delay(10000);
+    Serial.println("test_parser_fuzz");
+    randomSeed(1);
+
+    // Valid payloads must come back as they were sent.
+    for (int i = 0; i < TEST_PARSER_CASES; i++) {
+        int len = parser_random_payload((char *)buf, sizeof(buf), &expected);
+        bool ok = parse_value_payload(buf, len, &parsed) && parsed.ch == expected.ch &&
+                  parsed.value == expected.value &&
+                  strcmp(parsed.unit, expected.unit) == 0;
+        if (ok == false && ++mismatches <= 10) {
+            Serial.printf("mismatch: %.*s\n", len, buf);
+        }
+    }
+
+    // Broken frames must be rejected or parsed within the bounds.
+    for (int i = 0; i < TEST_PARSER_CASES; i++) {
+        const char *seed = parser_seeds[random(NUMBER_OF_PARSER_SEEDS)];
+        int len;
+        if (random(2)) {
+            len = strlen(seed);
+            memcpy(buf, seed, len);
+        } else {
+            len = frame_seal(buf, sizeof(buf), random(2) ? FrameValue : FrameTime, random(1000), seed, strlen(seed), frame_open_key);
+        }
+        len = parser_mutate(buf, len, sizeof(buf));
+
+        const uint8_t *payload;
+        uint8_t type;
+        Sender *sender;
+        int payload_len = accept_frame(mac, buf, len, &type, &payload, &sender);
+        if (payload_len >= 0 && type == FrameValue && parse_value_payload(payload, payload_len, &parsed)) {
+            accepted++;
+            if (strlen(parsed.unit) > MAX_UNIT_LEN) {
+                broken++;
+            }
+        }
+    }
+
+    // speed
+    static char payloads[64][32];
+    int lengths[64];
+    for (int i = 0; i < 64; i++) {
+        lengths[i] = parser_random_payload(payloads[i], sizeof(payloads[i]), &expected);
+    }
+    unsigned long started_at = micros();
+    for (int i = 0; i < TEST_PARSER_SPEED_RUNS; i++) {
+        parse_value_payload((const uint8_t *)payloads[i % 64], lengths[i % 64], &parsed);
+    }
+    unsigned long parser_us = micros() - started_at;
+    started_at = micros();
+    for (int i = 0; i < TEST_PARSER_SPEED_RUNS; i++) {
+        ushort ch;
+        float value;
+        char unit[MAX_UNIT_LEN + 1];
+        sscanf(payloads[i % 64], "%hu,%f,%15s", &ch, &value, unit);
+    }
+    unsigned long sscanf_us = micros() - started_at;
+
+    Serial.printf("test_parser_fuzz: %u mismatches, %u of %d broken frames accepted, %u out of bounds\n",
+        mismatches, accepted, TEST_PARSER_CASES, broken);
+    Serial.printf("  parse_value_payload %.0f frames/s, sscanf %.0f frames/s\n",
+        TEST_PARSER_SPEED_RUNS * 1e6 / max(parser_us, 1UL), TEST_PARSER_SPEED_RUNS * 1e6 / max(sscanf_us, 1UL));
 }
 #endif
 
@@ -1002,17 +1847,118 @@ void test_count_up_down() {
 static void test_light_patter() {
     for (int i = 0; i < (int)LIGHT_FOUR_FEVER + 1; i++) {
 Serial.printf("pattern: %d", i);
-        light_pattern = (LightPattern)i;
+        displays[0].calc().set_light_pattern((LightPattern)i);
         delay(10000);
     }    
 }
 #endif
 
 
+#ifdef TEST_RUNTIME_CONFIG
+#define TEST_CONTROL_INTERVAL   1000
+
+// Sends a control frame as an admin publisher. Another MAC sends it as a replay.
+static void test_control_send(uint32_t seq, uint32_t base_revision, const ControlItem *items, int count,
+                              uint8_t flags = 0, uint8_t mac_tail = 0xad) {
+    const uint8_t mac[6] = { 0x02, 0, 0, 0, 0, mac_tail };
+    uint8_t payload[sizeof(ControlHeader) + MAX_CONTROL_ITEMS * sizeof(ControlItem)];
+    ControlHeader header = { base_revision, flags, (uint8_t)count };
+    memcpy(payload, &header, sizeof(header));
+    memcpy(payload + sizeof(header), items, count * sizeof(ControlItem));
+
+    uint8_t frame[MAX_FRAME_LEN];
+    size_t len = frame_seal(frame, sizeof(frame), FrameControl, seq, payload,
+        sizeof(header) + count * sizeof(ControlItem), admin_key);
+    espnow_on_data_receive(mac, frame, len);
+}
+
+// Checks that a control frame is applied as a whole or not at all.
+// Each step checks the frame of the step before, since the radio task handles it meanwhile.
+static void test_runtime_config(unsigned long now) {
+    static int step = 0;
+    static unsigned long sent_at = 0;
+    static uint32_t revision = 0;
+    static uint32_t press_time = 0;
+    static int failures = 0;
+    const RuntimeConfig *config = config_store.config();
+    Display &display = displays[0];
+
+    if (step > 5 || now - sent_at < TEST_CONTROL_INTERVAL || display.actuator().busy()) { return; }
+    sent_at = now;
+
+    switch (step++) {
+    case 0: {
+        revision = config_store.revision();
+        press_time = display.keymap()->press_time(KeyEqual);
+        const ControlItem items[] = { { ParamRoundingInterval, 0, 10000 }, { ParamPriority, 3, 5 } };
+        test_control_send(1, revision, items, 2);
+        break;
+    }
+    case 1: {
+        // The rotation scores channel 3 by the new priority.
+        Scheduler &scheduler = display.scheduler();
+        bool ok = config->revision == revision + 1 && rounding_interval() == 10000 &&
+            scheduler.score(3, now, 0) - scheduler.score(4, now, 0) == 4 * PRIORITY_POINTS;
+        Serial.printf("test_runtime_config: apply %s\n", ok ? "ok" : "NG");
+        failures += ok == false;
+        // It's based on the old revision.
+        const ControlItem items[] = { { ParamBrightness, 0, 10 } };
+        test_control_send(2, revision, items, 1);
+        break;
+    }
+    case 2: {
+        bool ok = config->revision == revision + 1 && config->brightness == BRIGHTNESS;
+        Serial.printf("test_runtime_config: stale %s\n", ok ? "ok" : "NG");
+        failures += ok == false;
+        // The second item is out of range, so the first one isn't applied either.
+        const ControlItem items[] = { { ParamBrightness, 0, 20 }, { ParamMaxSpeed, 0, 5 } };
+        test_control_send(3, revision + 1, items, 2);
+        break;
+    }
+    case 3: {
+        bool ok = config->revision == revision + 1 && config->brightness == BRIGHTNESS && config->max_speed == 0;
+        Serial.printf("test_runtime_config: atomic %s\n", ok ? "ok" : "NG");
+        failures += ok == false;
+        // A replayed sequence number is dropped by the window of the sender.
+        const ControlItem items[] = { { ParamBrightness, 0, 30 } };
+        test_control_send(3, revision + 1, items, 1);
+        // The first frame replayed from a new MAC passes its window, but its revision is stale.
+        const ControlItem first[] = { { ParamRoundingInterval, 0, 10000 }, { ParamPriority, 3, 5 } };
+        test_control_send(1, revision, first, 2, 0, 0xae);
+        // Without a revision, it's stale whoever sends it.
+        test_control_send(5, 0, items, 1, 0, 0xaf);
+        break;
+    }
+    case 4: {
+        bool ok = config->revision == revision + 1 && config->brightness == BRIGHTNESS;
+        Serial.printf("test_runtime_config: replay %s\n", ok ? "ok" : "NG");
+        failures += ok == false;
+        // It's stored after state_lock is released. The host has no NVS, so it's applied but not stored.
+        const ControlItem items[] = { { ParamMaxSpeed, 0, 200 }, { ParamHoldTime, 0, 80 }, { ParamBrightness, 0, 40 } };
+        test_control_send(4, revision + 1, items, 3, CONTROL_PERSIST);
+        break;
+    }
+    case 5: {
+        // The display takes the timings while the pushers are idle.
+        uint32_t slower = display.keymap()->press_time(KeyEqual);
+        // The LED task takes the brightness with the next frame.
+        bool ok = config->revision == revision + 2 && slower > press_time && led_matrix.output_brightness() == 40;
+        Serial.printf("test_runtime_config: timings and brightness %s, press %u -> %u ms\n", ok ? "ok" : "NG",
+            press_time, slower);
+        failures += ok == false;
+        Serial.printf("test_runtime_config done: %d failures\n", failures);
+        break;
+    }
+    }
+}
+#endif
+
 void loop()
 {
     static int n = 0;
-    static int test_state = 0;
+#ifdef METRICS_REPORT
+    uint32_t loop_started_us = micros();
+#endif
     M5.update();
 
 #ifdef TEST_MODE
@@ -1027,79 +1973,79 @@ void loop()
     test_light_patter();
     return;
 #endif
+#ifdef TEST_ROTATION_COST
+    test_rotation_cost();
+    return;
+#endif
+#ifdef TEST_PLANNER_COST
+    test_planner_cost();
+    return;
+#endif
+#ifdef TEST_MOTION_PROFILE
+    test_motion_profile();
+    return;
+#endif
+#ifdef TEST_NOISY_SENSOR
+    test_noisy_sensor();
+    return;
+#endif
+#ifdef TEST_PARSER_FUZZ
+    test_parser_fuzz();
+    return;
+#endif
 
     // Set it invalid after one hour past
     unsigned long now = millis();
-    bool needs_to_change_current_channel = false;
-    for (int i = 1; i < NUMBER_OF_CHANNEL; i++) {
-        ChannelValue *channel_value = &channel_values[i];
-
-        if (channel_value->available &&
-            (now - channel_value->received_at >= INVALID_DATA_INTERVAL)) {
-            channel_value->available = false;
-            Serial.println("Invalid data");
-            if (i == current_channel) {
-                needs_to_change_current_channel = true;
-            }
-        }
+    xSemaphoreTake(state_lock, portMAX_DELAY);
+    if (channels.expire(now) > 0) {
+        Serial.println("Invalid data");
     }
 
-    // ラウンディングモード時はROUNDING_INTERVAL経過で次のチャンネルを表示する。
-    if (rounding) {
-        if (now - rounding_at >= ROUNDING_INTERVAL) {
-            needs_to_change_current_channel = true;
-            set_rounding(true, true);
-        }
-    } else {
-        if (current_channel != 0) {
-            // 最後の受信からROUNDING_INTERVAL経過したらラウンディングモードに戻す。
-            if (now - last_received_at >= ROUNDING_INTERVAL) {
-                // タイマーの場合は終了しているので無効にする。
-                if (strcmp(channel_values[current_channel].unit, "timer") == 0) {
-                    channel_values[current_channel].available = false;
-                }
-                needs_to_change_current_channel = true;
-                set_rounding(true, true);
-            }
-        }
+    // Each display presses its own servos, so they don't wait for each other.
+    bool advance = M5.BtnA.wasPressed();
+    for (int i = 0; i < NUMBER_OF_DISPLAYS; i++) {
+        displays[i].update(now, advance);
     }
-
-    if (M5.BtnA.wasPressed() || needs_to_change_current_channel)
-    {
-        int ch = current_channel;
-        for (int i = 0; i < NUMBER_OF_CHANNEL; i++) {
-            ch = (ch + 1) % NUMBER_OF_CHANNEL;
-            if (channel_values[ch].available) {
-                break;
-            }
-        }
-        if (current_channel == ch) { return; }
-
-        current_channel = ch;
-        Serial.printf("The current channel is %d\n", current_channel);
-        // Quit the rounding mode if channel no is return to zero.
-        if (current_channel == 0) {
-            set_rounding(false);
-        }
-        display();
+#ifdef TEST_RUNTIME_CONFIG
+    test_runtime_config(now);
+#endif
+#ifdef METRICS_REPORT
+    static unsigned long metrics_at = now;
+    if (espnow_setuped && now - metrics_at >= METRICS_INTERVAL) {
+        metrics_at = now;
+        send_metrics(now);
     }
+#endif
 
     if (M5.BtnA.wasReleaseFor(1000)) {
-        current_channel = 0;
-        calc.clear_all();
-        display();
+        for (int i = 0; i < NUMBER_OF_DISPLAYS; i++) {
+            displays[i].reset();
+        }
     }
+    xSemaphoreGive(state_lock);
+
+    time_service.update();
 
     // update time
     if (++n >= (1000 / 10))
     {
         n = 0;
         update_time();
+#ifndef OFFLINE_TEST
         if (time_available) {
             espnow_setup_if_needed();
         }
+#endif
+    }
+
+    static unsigned long reported_at = now;
+    if (now - reported_at >= TASK_REPORT_INTERVAL) {
+        reported_at = now;
+        report_tasks();
     }
 
-    display();
+#ifdef METRICS_REPORT
+    loop_latency.add(micros() - loop_started_us);
+#endif
     delay(10);
 }
@@ -0,0 +1,63 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <protocol.h>
+
+// Counts the time of loop() for the metrics frame.
+class LoopLatency
+{
+private:
+    uint16_t _buckets[METRICS_LATENCY_BUCKETS] = {};
+    uint32_t _max_us = 0;
+
+public:
+
+    void add(uint32_t us)
+    {
+        uint32_t ms = us / 1000;
+        int i = 0;
+        while (i < METRICS_LATENCY_BUCKETS - 1 && ms >= (1UL << i)) {
+            i++;
+        }
+        if (_buckets[i] < UINT16_MAX) {
+            _buckets[i]++;
+        }
+        _max_us = max(_max_us, us);
+    }
+
+    // Moves the counts to the payload and starts again.
+    void take(MetricsPayload *metrics)
+    {
+        memcpy(metrics->loop_latency, _buckets, sizeof(_buckets));
+        metrics->max_loop_ms = min(_max_us / 1000, (uint32_t)UINT16_MAX);
+        memset(_buckets, 0, sizeof(_buckets));
+        _max_us = 0;
+    }
+};
+
+#endif
@@ -0,0 +1,108 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _MOTION_H_
+#define _MOTION_H_
+
+#include <math.h>
+
+// The pushers write the angle at 200 Hz while moving.
+#define SERVO_UPDATE_INTERVAL   5
+// Time for the servo to catch up with the end of a move.
+#define SERVO_SETTLE_TIME       20
+
+// A trapezoidal move: it accelerates, runs at the max speed and decelerates to stop at the end.
+// A short move doesn't reach the max speed and becomes a triangle.
+class MotionProfile
+{
+private:
+    float _from = 0;
+    float _distance = 0;
+    float _direction = 1;
+    // deg/ms and deg/ms^2
+    float _accel = 0;
+    float _peak_speed = 0;
+    float _accel_time = 0;
+    float _cruise_time = 0;
+
+public:
+
+    // max_speed is in deg/s and max_accel is in deg/s^2.
+    void plan(float from, float to, uint16_t max_speed, uint16_t max_accel)
+    {
+        float speed = max_speed / 1000.0f;
+        _from = from;
+        _distance = fabsf(to - from);
+        _direction = to < from ? -1 : 1;
+        _accel = max_accel / 1000000.0f;
+
+        _accel_time = speed / _accel;
+        if (_distance < speed * _accel_time) {
+            _accel_time = sqrtf(_distance / _accel);
+            _cruise_time = 0;
+        } else {
+            _cruise_time = (_distance - speed * _accel_time) / speed;
+        }
+        _peak_speed = _accel * _accel_time;
+    }
+
+    // in ms
+    float duration() const
+    {
+        return 2 * _accel_time + _cruise_time;
+    }
+
+    // The angle at t ms from the start.
+    float at(float t) const
+    {
+        float s;
+        if (t <= 0) {
+            s = 0;
+        } else
+        if (t < _accel_time) {
+            s = _accel * t * t / 2;
+        } else
+        if (t < _accel_time + _cruise_time) {
+            s = _accel * _accel_time * _accel_time / 2 + _peak_speed * (t - _accel_time);
+        } else
+        if (t < duration()) {
+            float remains = duration() - t;
+            s = _distance - _accel * remains * remains / 2;
+        } else {
+            s = _distance;
+        }
+        return _from + _direction * s;
+    }
+};
+
+// Time in ms to move the distance and settle.
+static uint32_t motion_time(int distance, uint16_t max_speed, uint16_t max_accel)
+{
+    MotionProfile motion;
+    motion.plan(0, distance, max_speed, max_accel);
+    return (uint32_t)ceilf(motion.duration()) + SERVO_SETTLE_TIME;
+}
+
+#endif
@@ -0,0 +1,469 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _PLANNER_H_
+#define _PLANNER_H_
+
+#include "keymap.h"
+#include "actuator.h"
+
+// int holds 9 places of hundredths, up to 9,999,999.99.
+#define MAX_WALK_PLACES         9
+#define NO_COST                 0xffffffffUL
+
+// Plans the key sequence to walk the value on the calculator.
+// Values are in hundredths, e.g. 12:34 is 1234.
+//
+// It walks with constants: "+ . 0 1 =" adds 0.01 and each "=" after it adds 0.01 again.
+// Each place is walked straight, or folded over with a carry to the next place
+// (+0.07 as +0.10 -0.03), whichever costs less. Before walking, it can clear the calculator
+// or type a value made of 1 and 0 like "1 0 . 1" after "CA", when it costs less in total.
+class Planner
+{
+public:
+
+    typedef enum
+    {
+        Unknown,
+        // No constant is entered.
+        Clear,
+        // A constant is entered. "=" adds _constant.
+        Walking,
+    } mode;
+
+    // How set_value() starts the walk.
+    typedef enum
+    {
+        // from the current value
+        WalkFromValue,
+        // "CA =" and from zero
+        ClearAndWalk,
+        // "CA", a typed value and from it
+        TypeAndWalk,
+        NUMBER_OF_STRATEGIES,
+    } strategy;
+
+private:
+    mode _mode = Unknown;
+    int _value = 0;
+    // the step of the entered constant, like 1, -10 or 100.
+    int _constant = 0;
+    const KeyMap *_keymap = NULL;
+    // NULL to plan without pressing.
+    Actuator *_actuator = NULL;
+    // sum of press_time() of the planned keys.
+    uint32_t _cost = 0;
+    uint32_t _presses = 0;
+    // how many times each strategy is chosen.
+    uint32_t _wins[NUMBER_OF_STRATEGIES] = {};
+    // Test modes watch the planned keys with it.
+    void (*_listener)(Key key, void *context) = NULL;
+    void *_listener_context = NULL;
+
+    static int step_of(int place)
+    {
+        int step = 1;
+        for (int i = 0; i < place; i++) {
+            step *= 10;
+        }
+        return step;
+    }
+
+    // Time to enter the constant of the place, e.g. "+ . 0 1" for the place 0.
+    uint32_t constant_cost(bool add, int place)
+    {
+        uint32_t cost = _keymap->press_time(add ? KeyPlus : KeyMinus);
+        switch (place) {
+        case 0:
+            return cost + _keymap->press_time(KeyDot) + _keymap->press_time(KeyZero) + _keymap->press_time(KeyOne);
+        case 1:
+            return cost + _keymap->press_time(KeyDot) + _keymap->press_time(KeyOne);
+        default:
+            return cost + _keymap->press_time(KeyOne) + (place - 2) * _keymap->press_time(KeyZero);
+        }
+    }
+
+    // Plans the steps of each place to walk diff. steps[place] is signed.
+    // constant is the step which is entered already, or 0.
+    // Returns the time to press them.
+    uint32_t plan_walk(int diff, int constant, int *steps)
+    {
+        int places = walk_places();
+        int top = places - 1;
+        bool add = diff >= 0;
+        uint32_t magnitude = abs(diff);
+        uint32_t equal = _keymap->press_time(KeyEqual);
+
+        // the least cost so far with or without the carry to the next place.
+        uint32_t cost[2] = { 0, NO_COST };
+        // the carry from the previous place and the steps, to trace back the choices.
+        int8_t from[MAX_WALK_PLACES][2];
+        int8_t count[MAX_WALK_PLACES][2];
+
+        uint32_t base = 1;
+        for (int place = 0; place < places; place++, base *= 10) {
+            uint32_t next[2] = { NO_COST, NO_COST };
+            // The top place takes all the rest, so it can go over 9.
+            int digit = place == top ? magnitude / base : (magnitude / base) % 10;
+
+            for (int carry = 0; carry < 2; carry++) {
+                if (cost[carry] == NO_COST) { continue; }
+                int n = digit + carry;
+
+                // straight
+                uint32_t c = cost[carry];
+                if (n > 0) {
+                    c += n * equal;
+                    if (constant != (add ? 1 : -1) * step_of(place)) { c += constant_cost(add, place); }
+                }
+                if (c < next[0]) {
+                    next[0] = c;
+                    from[place][0] = carry;
+                    count[place][0] = add ? n : -n;
+                }
+
+                // folded over with a carry. The top place can't carry.
+                if (place == top || n == 0) { continue; }
+                c = cost[carry] + (10 - n) * equal;
+                if (constant != (add ? -1 : 1) * step_of(place)) { c += constant_cost(!add, place); }
+                if (c < next[1]) {
+                    next[1] = c;
+                    from[place][1] = carry;
+                    count[place][1] = add ? -(10 - n) : 10 - n;
+                }
+            }
+            cost[0] = next[0];
+            cost[1] = next[1];
+        }
+
+        int carry = 0;
+        for (int place = top; place >= 0; place--) {
+            steps[place] = count[place][carry];
+            carry = from[place][carry];
+        }
+        return cost[0];
+    }
+
+    // Time to type the value, like "1 0 . 1" for 10.10. Its digits are 1 or 0.
+    uint32_t entry_cost(int typed)
+    {
+        uint32_t cost = 0;
+        for (int integer = typed / 100; integer > 0; integer /= 10) {
+            cost += _keymap->press_time(integer % 10 ? KeyOne : KeyZero);
+        }
+        int decimals = typed % 100;
+        if (decimals > 0) {
+            cost += _keymap->press_time(KeyDot) + _keymap->press_time(decimals >= 10 ? KeyOne : KeyZero);
+            if (decimals % 10) {
+                cost += _keymap->press_time(KeyOne);
+            }
+        }
+        return cost;
+    }
+
+    // Clears and types the value. No constant is entered after it.
+    void type_value(int typed)
+    {
+        push_clear_all();
+        int integer = typed / 100;
+        int base = 1;
+        while (base * 10 <= integer) {
+            base *= 10;
+        }
+        for (; integer > 0 && base > 0; base /= 10) {
+            (integer / base) % 10 ? push_one() : push_zero();
+        }
+        int decimals = typed % 100;
+        if (decimals > 0) {
+            push_dot();
+            decimals >= 10 ? push_one() : push_zero();
+            if (decimals % 10) {
+                push_one();
+            }
+        }
+        _mode = Clear;
+        _value = typed;
+        _constant = 0;
+    }
+
+    // Presses "=" times on the place. It enters the constant if it isn't yet.
+    void walk(int place, int times)
+    {
+        if (times == 0) { return; }
+
+        int step = (times > 0 ? 1 : -1) * step_of(place);
+        if (_mode != Walking || _constant != step) {
+            times > 0 ? push_plus() : push_minus();
+            if (place == 0) {
+                push_dot();
+                push_zero();
+                push_one();
+            } else
+            if (place == 1) {
+                push_dot();
+                push_one();
+            } else {
+                push_one();
+                for (int i = 2; i < place; i++) {
+                    push_zero();
+                }
+            }
+            _mode = Walking;
+            _constant = step;
+        }
+        for (int i = 0; i < abs(times); i++) {
+            push_equal();
+            _value += step;
+        }
+    }
+
+    // The direction, 1 or -1, to walk first from the value so that it stays on the calculator,
+    // or 0 if neither does. The value and the target fit, but the steps of a direction can go
+    // over it, like +0.01 before -0.30 from 999.99. The direction of the entered constant is preferred.
+    int first_direction(const int *steps)
+    {
+        int64_t limit = max_value();
+        int64_t up = 0;
+        int64_t down = 0;
+        for (int place = 0; place < walk_places(); place++) {
+            (steps[place] > 0 ? up : down) += (int64_t)steps[place] * step_of(place);
+        }
+        bool up_fits = _value + up <= limit;
+        bool down_fits = _value + down >= -limit;
+        if (_mode == Walking && _constant < 0) {
+            return down_fits ? -1 : up_fits ? 1 : 0;
+        }
+        return up_fits ? 1 : down_fits ? -1 : 0;
+    }
+
+    // Walks the steps of a direction, 1 or -1, and clears them.
+    // The place of the entered constant goes first, so that it's not entered again.
+    void walk_steps(int *steps, int direction)
+    {
+        int places = walk_places();
+        for (int place = 0; place < places; place++) {
+            if (_mode == Walking && steps[place] * direction > 0 && direction * step_of(place) == _constant) {
+                walk(place, steps[place]);
+                steps[place] = 0;
+            }
+        }
+        for (int place = 0; place < places; place++) {
+            if (steps[place] * direction > 0) {
+                walk(place, steps[place]);
+                steps[place] = 0;
+            }
+        }
+    }
+
+public:
+
+    void begin(const KeyMap *keymap, Actuator *actuator)
+    {
+        _keymap = keymap;
+        _actuator = actuator;
+    }
+
+    mode current_mode() { return _mode; }
+    int value() { return _value; }
+    int constant() { return _constant; }
+    uint32_t cost() { return _cost; }
+    uint32_t presses() const { return _presses; }
+    uint32_t wins(strategy s) { return _wins[s]; }
+
+    void set_listener(void (*listener)(Key key, void *context), void *context)
+    {
+        _listener = listener;
+        _listener_context = context;
+    }
+
+    // Places the planner can walk: the digits of the calculator or what int holds.
+    int walk_places()
+    {
+        return min((int)_keymap->digits, MAX_WALK_PLACES);
+    }
+
+    // The largest value which the calculator can show.
+    int max_value()
+    {
+        return step_of(walk_places()) - 1;
+    }
+
+    // Time in ms to walk from the current value to v without clearing.
+    // It's NO_COST while the calculator state is unknown.
+    uint32_t walk_cost(int v)
+    {
+        int steps[MAX_WALK_PLACES];
+        if (_mode == Unknown) { return NO_COST; }
+        uint32_t cost = plan_walk(v - _value, _mode == Walking ? _constant : 0, steps);
+        return first_direction(steps) ? cost : NO_COST;
+    }
+
+    // Time in ms to clear and walk from zero to v.
+    uint32_t clear_cost(int v)
+    {
+        int steps[MAX_WALK_PLACES];
+        return _keymap->press_time(KeyClearAll) + _keymap->press_time(KeyEqual) + plan_walk(v, 0, steps);
+    }
+
+    // Time in ms to clear, type a value of 1 and 0 and walk from it to v.
+    // typed is set to the value to type.
+    uint32_t type_cost(int v, int *typed)
+    {
+        int steps[MAX_WALK_PLACES];
+        int magnitude = abs(v);
+        int places = 1;
+        while (places < walk_places() && step_of(places) <= magnitude) {
+            places++;
+        }
+        // one more place, so that 9.50 can be typed as 10.
+        places = min(places + 1, walk_places());
+
+        uint32_t best = NO_COST;
+        for (int bits = 1; bits < (1 << places); bits++) {
+            int t = 0;
+            for (int place = places - 1; place >= 0; place--) {
+                t = t * 10 + ((bits >> place) & 1);
+            }
+            uint32_t cost = entry_cost(t);
+            if (cost >= best) { continue; }
+            cost += plan_walk(v - t, 0, steps);
+            if (cost < best) {
+                best = cost;
+                *typed = t;
+            }
+        }
+        return _keymap->press_time(KeyClearAll) + best;
+    }
+
+    // Time in ms to enter v again from "CA", as after invalidate().
+    uint32_t resync_cost(int v)
+    {
+        int typed;
+        return min(clear_cost(v), type_cost(v, &typed));
+    }
+
+    // Picks the strategy which reaches v in the least time.
+    strategy choose(int v, uint32_t *cost, int *typed)
+    {
+        strategy chosen = WalkFromValue;
+        *cost = walk_cost(v);
+
+        uint32_t c = clear_cost(v);
+        if (c < *cost) {
+            chosen = ClearAndWalk;
+            *cost = c;
+        }
+        c = type_cost(v, typed);
+        if (c < *cost) {
+            chosen = TypeAndWalk;
+            *cost = c;
+        }
+        return chosen;
+    }
+
+    // A copy in the same state which plans without pressing. Its cost and presses start at 0.
+    Planner dry_run() const
+    {
+        Planner copy = *this;
+        copy._actuator = NULL;
+        copy._listener = NULL;
+        copy._cost = 0;
+        copy._presses = 0;
+        return copy;
+    }
+
+    // Time in ms to walk from the current value to v, without pressing.
+    uint32_t estimate(int v)
+    {
+        Planner copy = dry_run();
+        copy.set_value(v);
+        return copy._cost;
+    }
+
+    // The key is pressed later by the actuator. _value is the value after all queued keys are pressed.
+    void push(Key key)
+    {
+        _cost += _keymap->press_time(key);
+        _presses++;
+        if (_actuator) {
+            _actuator->push(key);
+        }
+        if (_listener) {
+            _listener(key, _listener_context);
+        }
+    }
+
+    void push_clear_all() { push(KeyClearAll); }
+    void push_one() { push(KeyOne); }
+    void push_zero() { push(KeyZero); }
+    void push_dot() { push(KeyDot); }
+    void push_plus() { push(KeyPlus); }
+    void push_equal() { push(KeyEqual); }
+    void push_minus() { push(KeyMinus); }
+
+    // Forgets the calculator state, e.g. after a missed press. The next set_value() clears it.
+    void invalidate()
+    {
+        _mode = Unknown;
+    }
+
+    void clear_all()
+    {
+        push_clear_all();
+        push_equal();
+        _mode = Clear;
+        _value = 0;
+        _constant = 0;
+    }
+
+    void set_value(int v) {
+        int limit = max_value();
+        if (v > limit || v < -limit) {
+            Serial.printf("%d is out of the calculator.\n", v);
+            v = constrain(v, -limit, limit);
+        }
+        if (_value == v && _mode != Unknown) { return; }
+
+        uint32_t cost;
+        int typed = 0;
+        strategy chosen = choose(v, &cost, &typed);
+        _wins[chosen]++;
+        if (chosen == ClearAndWalk) {
+            clear_all();
+        } else
+        if (chosen == TypeAndWalk) {
+            type_value(typed);
+        }
+
+        int steps[MAX_WALK_PLACES];
+        plan_walk(v - _value, _mode == Walking ? _constant : 0, steps);
+
+        int first = first_direction(steps) < 0 ? -1 : 1;
+        walk_steps(steps, first);
+        walk_steps(steps, -first);
+    }
+};
+
+#endif
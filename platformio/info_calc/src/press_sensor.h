@@ -0,0 +1,85 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _PRESS_SENSOR_H_
+#define _PRESS_SENSOR_H_
+
+// No pin to sense the presses.
+#define NO_PRESS_SENSE          -1
+// A servo stalled on a key draws this much more than the idle servos, in mV on the sense pin.
+#define PRESS_SENSE_THRESHOLD   100
+// The baseline follows the idle current by 1/16 of the difference.
+#define PRESS_SENSE_SHIFT       4
+
+// Confirms presses by the current of the servos.
+// The servo supply goes through a shunt and its amplified voltage goes to an ADC1 pin.
+// ADC2 doesn't work while the radio is on.
+class PressSensor
+{
+private:
+    int _pin = NO_PRESS_SENSE;
+    // mV << PRESS_SENSE_SHIFT
+    uint32_t _baseline = 0;
+    uint32_t _peak = 0;
+
+public:
+
+    void begin(int pin)
+    {
+        _pin = pin;
+        if (_pin == NO_PRESS_SENSE) { return; }
+        pinMode(_pin, INPUT);
+        _baseline = analogReadMilliVolts(_pin) << PRESS_SENSE_SHIFT;
+    }
+
+    bool enabled() { return _pin != NO_PRESS_SENSE; }
+
+    // Call it while no pusher moves.
+    void idle()
+    {
+        uint32_t mv = analogReadMilliVolts(_pin);
+        _baseline += mv - (_baseline >> PRESS_SENSE_SHIFT);
+    }
+
+    // Call it when a press starts.
+    void start()
+    {
+        _peak = 0;
+    }
+
+    // Call it while the pusher is on the key.
+    void sample()
+    {
+        _peak = max(_peak, analogReadMilliVolts(_pin));
+    }
+
+    // True if the current went up while the pusher was on the key.
+    bool confirmed()
+    {
+        return _peak >= (_baseline >> PRESS_SENSE_SHIFT) + PRESS_SENSE_THRESHOLD;
+    }
+};
+
+#endif
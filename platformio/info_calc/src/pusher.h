@@ -25,6 +25,13 @@ SOFTWARE.
 #ifndef _PUSHER_H_
 #define _PUSHER_H_
 
+#include "keymap.h"
+#include "motion.h"
+
+// pulse widths of 0 and 180 degrees
+#define SERVO_MIN_US            500
+#define SERVO_MAX_US            2400
+
 // for pusher
 typedef enum
 {
@@ -35,48 +42,102 @@ typedef enum
     ServoStateB,
 } ServoState;
 
+typedef enum
+{
+    PressIdle,
+    PressOn,
+    PressOff,
+} PressPhase;
+
 class Pusher
 {
 private:
     Servo _servo;
-    int _pin_no;
     ServoState _state;
     ServoState _ex_state;
-    int _adjust_angle;
-    int _a_angle;
-    int _b_angle;
-    int _on_time;
-    int _off_time;
+    // the pin, the angles and the motion profile, or the fixed waits when max_speed is 0.
+    PusherConfig _config;
+    // times of the current press
+    uint32_t _on_time;
+    uint32_t _off_time;
+    PressPhase _phase;
+    unsigned long _phase_at;
+    // the move of the current phase when max_speed is set.
+    MotionProfile _motion;
+    unsigned long _written_at;
 
     int angle()
     {
         switch (_state)
         {
         case ServoStateA:
-            return 90 - _a_angle + _adjust_angle;
+            return 90 - _config.a_angle + _config.adjust_angle;
         case ServoStateB:
-            return 90 + _b_angle + _adjust_angle;
+            return 90 + _config.b_angle + _config.adjust_angle;
         default:
-            return 90 + _adjust_angle;
+            return 90 + _config.adjust_angle;
         }
     }
 
+    void write_angle(float degrees)
+    {
+        _servo.writeMicroseconds(SERVO_MIN_US + (int)(degrees * (SERVO_MAX_US - SERVO_MIN_US) / 180 + 0.5f));
+    }
+
+    // Starts moving to the angle of the state. It jumps without the motion profile.
+    void move_to(ServoState state, unsigned long now)
+    {
+        if (_config.max_speed == 0)
+        {
+            setState(state);
+            return;
+        }
+        float from = angle();
+        _state = _ex_state = state;
+        _motion.plan(from, angle(), _config.max_speed, _config.max_accel);
+        // It's written on the next update().
+        _written_at = now - SERVO_UPDATE_INTERVAL;
+    }
+
+    // Writes the angle of the move at most every SERVO_UPDATE_INTERVAL.
+    void follow_motion(unsigned long elapsed, unsigned long now)
+    {
+        if (_config.max_speed == 0 || now - _written_at < SERVO_UPDATE_INTERVAL) { return; }
+        // The end of the move is written already.
+        if (elapsed > _motion.duration() + SERVO_UPDATE_INTERVAL) { return; }
+        _written_at = now;
+        write_angle(_motion.at(elapsed));
+    }
+
 public:
     Pusher(int pin_no, int a_angle = 10, int b_angle = 10, int adjust_angle = 0)
     {
-        _pin_no = pin_no;
         _state = _ex_state = ServoStateInit;
-        _a_angle = a_angle;
-        _b_angle = b_angle;
-        _adjust_angle = adjust_angle;
-        _on_time = 150;
-        _off_time = 150;
+        _config = {};
+        _config.pin_no = pin_no;
+        _config.a_angle = a_angle;
+        _config.b_angle = b_angle;
+        _config.adjust_angle = adjust_angle;
+        _config.on_time = _on_time = 150;
+        _config.off_time = _off_time = 150;
+        _phase = PressIdle;
+        _phase_at = 0;
+        _written_at = 0;
+    }
+
+    Pusher() : Pusher(-1)
+    {
+    }
+
+    void configure(const PusherConfig *config)
+    {
+        _config = *config;
     }
 
     void begin()
     {
         _servo.setPeriodHertz(50);
-        _servo.attach(_pin_no, 500, 2400);
+        _servo.attach(_config.pin_no, 500, 2400);
         setState(ServoStateOffA);
     }
 
@@ -107,20 +168,75 @@ public:
         setState(_state);
     }
 
+    // Starts pressing without waiting. Call update() until it returns false.
+    // The times are same as KeyMap::press_time() counts.
+    void press(PusherSide side, unsigned long now)
+    {
+        _on_time = _config.press_on_time(side);
+        _off_time = _config.press_off_time(side);
+        move_to(side == SideA ? ServoStateA : ServoStateB, now);
+        _phase = PressOn;
+        _phase_at = now;
+    }
+
+    // Returns true while pressing.
+    bool update(unsigned long now)
+    {
+        unsigned long elapsed = now - _phase_at;
+        switch (_phase)
+        {
+        case PressOn:
+            follow_motion(elapsed, now);
+            if (elapsed >= _on_time)
+            {
+                move_to(_state == ServoStateA ? ServoStateOffA : ServoStateOffB, now);
+                _phase = PressOff;
+                _phase_at = now;
+            }
+            break;
+        case PressOff:
+            follow_motion(elapsed, now);
+            if (elapsed >= _off_time)
+            {
+                _phase = PressIdle;
+            }
+            break;
+        default:
+            break;
+        }
+        return busy();
+    }
+
+    bool busy()
+    {
+        return _phase != PressIdle;
+    }
+
+    // True while the pusher should be on the key, at the end of the on time.
+    bool on_key(unsigned long now)
+    {
+        if (_phase != PressOn) { return false; }
+        uint32_t hold = _config.max_speed ? _config.hold_time : _on_time / 2;
+        return now - _phase_at + hold >= _on_time;
+    }
+
+    void push(PusherSide side)
+    {
+        press(side, millis());
+        while (update(millis()))
+        {
+            delay(1);
+        }
+    }
+
     void push_a()
     {
-        setState(ServoStateA);
-        delay(_on_time);
-        setState(ServoStateOffA);
-        delay(_off_time);
+        push(SideA);
     }
 
     void push_b()
     {
-        setState(ServoStateB);
-        delay(_on_time);
-        setState(ServoStateOffB);
-        delay(_off_time);
+        push(SideB);
     }
 };
 
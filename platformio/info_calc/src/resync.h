@@ -0,0 +1,108 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _RESYNC_H_
+#define _RESYNC_H_
+
+// A missed press leaves the calculator off the planned value until it's cleared.
+// The display clears it and enters the value again now and then, when it's idle.
+#define RESYNC_INTERVAL         (60 * 60 * 1000UL)
+// Confirmed presses rarely drift, so it resyncs less often with a press sensor.
+#define RESYNC_VERIFIED_INTERVAL (6 * RESYNC_INTERVAL)
+// presses which make it due before the interval
+#define RESYNC_PRESSES          2000
+// It waits for a value which is entered again within this time, until it's overdue.
+#define RESYNC_CHEAP_COST       3000
+
+// Decides when to resync and counts the drifts.
+class ResyncScheduler
+{
+private:
+    unsigned long _interval = RESYNC_INTERVAL;
+    unsigned long _resynced_at = 0;
+    uint32_t _presses_at = 0;
+    uint32_t _resyncs = 0;
+    // drifts found by the press sensor and by the user with a long press.
+    uint32_t _lost_drifts = 0;
+    uint32_t _manual_drifts = 0;
+    // presses from the last resync to the drifts.
+    uint32_t _presses_to_drift = 0;
+
+    bool overdue(unsigned long now)
+    {
+        return now - _resynced_at >= 2 * _interval;
+    }
+
+public:
+
+    void begin(unsigned long interval, unsigned long now)
+    {
+        _interval = interval;
+        _resynced_at = now;
+    }
+
+    bool due(unsigned long now, uint32_t presses)
+    {
+        return now - _resynced_at >= _interval || presses - _presses_at >= RESYNC_PRESSES;
+    }
+
+    // True if it's a good time to resync: it's due, entering the value again ends
+    // before the display changes, and it's cheap or overdue.
+    // cost and window are in ms.
+    bool should_resync(unsigned long now, uint32_t presses, uint32_t cost, uint32_t window)
+    {
+        if (due(now, presses) == false || cost > window) { return false; }
+        return cost <= RESYNC_CHEAP_COST || overdue(now);
+    }
+
+    void on_resync(unsigned long now, uint32_t presses)
+    {
+        _resyncs++;
+        _resynced_at = now;
+        _presses_at = presses;
+    }
+
+    // The calculator was found off. It's cleared, so it counts as a resync.
+    void on_drift(bool manual, unsigned long now, uint32_t presses)
+    {
+        manual ? _manual_drifts++ : _lost_drifts++;
+        _presses_to_drift += presses - _presses_at;
+        _resynced_at = now;
+        _presses_at = presses;
+    }
+
+    uint32_t resyncs() { return _resyncs; }
+    uint32_t drifts() { return _lost_drifts + _manual_drifts; }
+    uint32_t lost_drifts() { return _lost_drifts; }
+    uint32_t manual_drifts() { return _manual_drifts; }
+
+    // average presses from a resync to a drift
+    uint32_t presses_per_drift()
+    {
+        return drifts() ? _presses_to_drift / drifts() : 0;
+    }
+};
+
+#endif
@@ -0,0 +1,268 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include "channel_table.h"
+#include "planner.h"
+#include "tour.h"
+
+typedef enum
+{
+    // the channel with the best score next.
+    RotationByScore,
+    // the order which needs the fewest presses for a cycle over all channels.
+    // It ignores the priorities and the staleness weights of the channels.
+    RotationByTour,
+} RotationOrder;
+
+struct ChannelPolicy {
+    // A larger one is shown first.
+    uint8_t priority;
+    // points per second since the channel was shown last.
+    uint8_t staleness_weight;
+    // seconds to keep showing the channel before moving to another one.
+    uint16_t min_dwell;
+    // Show the channel as soon as its value changes.
+    bool show_on_change;
+};
+
+static const ChannelPolicy default_channel_policy = { 1, 1, 10, false };
+
+// Policies are shared by all displays.
+static ChannelPolicy channel_policies[MAX_CHANNELS];
+
+static void init_channel_policies()
+{
+    for (int i = 0; i < MAX_CHANNELS; i++) {
+        channel_policies[i] = default_channel_policy;
+    }
+}
+
+#define PRIORITY_POINTS         1000
+#define CHANGE_POINTS           500
+// ms of actuation per point
+#define COST_DIVISOR            100
+// costs refresh_costs() computes in a call
+#define COST_REFRESH_BUDGET     8
+
+// Picks the next channel of the rotation of a display.
+// A channel gets points by its priority, the time since it was shown and a change of its value,
+// and loses points by the time to walk the calculator to its value.
+class Scheduler
+{
+private:
+    ChannelTable *_channels = NULL;
+    RotationOrder _order = RotationByScore;
+    RotationTour _tour;
+    unsigned long _shown_at[MAX_CHANNELS];
+    // channels whose value changed since they were shown.
+    uint32_t _changed[MAX_CHANNELS / 32];
+    int _current = 0;
+    unsigned long _current_at = 0;
+    // Walk costs by channel for the calculator state below. A cost is computed again
+    // only when the target of its channel or the state changes.
+    uint32_t _costs[MAX_CHANNELS];
+    int _cost_targets[MAX_CHANNELS];
+    uint32_t _cost_valid[MAX_CHANNELS / 32];
+    Planner::mode _cost_mode = Planner::Unknown;
+    int _cost_value = 0;
+    int _cost_constant = 0;
+
+    bool changed(int ch) { return (_changed[ch / 32] >> (ch % 32)) & 1; }
+    bool cost_valid(int ch) { return (_cost_valid[ch / 32] >> (ch % 32)) & 1; }
+
+    // Forgets the costs if the calculator state has changed since they were computed.
+    void check_cost_state(Planner *planner)
+    {
+        if (planner->current_mode() != _cost_mode || planner->value() != _cost_value ||
+            planner->constant() != _cost_constant) {
+            invalidate_costs();
+            _cost_mode = planner->current_mode();
+            _cost_value = planner->value();
+            _cost_constant = planner->constant();
+        }
+    }
+
+    template <class TargetFunction>
+    uint32_t cost_of(int ch, Planner *planner, TargetFunction target)
+    {
+        int t = target(ch);
+        if (cost_valid(ch) == false || _cost_targets[ch] != t) {
+            _costs[ch] = planner->estimate(t);
+            _cost_targets[ch] = t;
+            _cost_valid[ch / 32] |= 1UL << (ch % 32);
+        }
+        return _costs[ch];
+    }
+
+public:
+
+    void begin(ChannelTable *channels, RotationOrder order = RotationByScore)
+    {
+        _channels = channels;
+        _order = order;
+        memset(_shown_at, 0, sizeof(_shown_at));
+        memset(_changed, 0, sizeof(_changed));
+        invalidate_costs();
+    }
+
+    // Call it when the press times change.
+    void invalidate_costs()
+    {
+        memset(_cost_valid, 0, sizeof(_cost_valid));
+    }
+
+    // Computes a few of the stale costs, so that pick() finds most of them ready.
+    // Call it while the display waits for the next pick.
+    template <class TargetFunction>
+    void refresh_costs(Planner *planner, TargetFunction target)
+    {
+        check_cost_state(planner);
+        int budget = COST_REFRESH_BUDGET;
+        int first = _channels->next_available(_current);
+        int ch = first;
+
+        do {
+            int t = target(ch);
+            if (ch != _current && (cost_valid(ch) == false || _cost_targets[ch] != t)) {
+                cost_of(ch, planner, target);
+                if (--budget == 0) { break; }
+            }
+            ch = _channels->next_available(ch);
+        } while (ch != first);
+    }
+
+    void on_receive(int ch, bool value_changed)
+    {
+        if (value_changed) {
+            _changed[ch / 32] |= 1UL << (ch % 32);
+        }
+    }
+
+    void on_shown(int ch, unsigned long now)
+    {
+        _shown_at[ch] = now;
+        _changed[ch / 32] &= ~(1UL << (ch % 32));
+        if (ch != _current) {
+            _current = ch;
+            _current_at = now;
+        }
+    }
+
+    bool dwell_elapsed(unsigned long now)
+    {
+        return now - _current_at >= channel_policies[_current].min_dwell * 1000UL;
+    }
+
+    // Returns a show-on-change channel whose value changed, or -1.
+    int changed_channel()
+    {
+        for (int i = 0; i < MAX_CHANNELS / 32; i++) {
+            uint32_t bits = _changed[i];
+            while (bits) {
+                int ch = i * 32 + __builtin_ctz(bits);
+                bits &= bits - 1;
+                if (ch != _current && channel_policies[ch].show_on_change && _channels->available(ch)) {
+                    return ch;
+                }
+            }
+        }
+        return -1;
+    }
+
+    long score(int ch, unsigned long now, uint32_t cost)
+    {
+        const ChannelPolicy *policy = &channel_policies[ch];
+        long points = (long)policy->priority * PRIORITY_POINTS;
+
+        points += (long)policy->staleness_weight * ((now - _shown_at[ch]) / 1000);
+        if (policy->show_on_change && changed(ch)) {
+            points += CHANGE_POINTS;
+        }
+        return points - (long)(cost / COST_DIVISOR);
+    }
+
+    // target(ch) returns the value of the channel in hundredths.
+    template <class TargetFunction>
+    int pick(unsigned long now, Planner *planner, TargetFunction target)
+    {
+        if (_order == RotationByTour) {
+            int ch = pick_in_tour(planner, target);
+            if (ch >= 0) { return ch; }
+        }
+
+        check_cost_state(planner);
+        int best = -1;
+        long best_score = 0;
+        // Channel 0 is always available, so the loop ends.
+        int first = _channels->next_available(_current);
+        int ch = first;
+
+        do {
+            if (ch != _current) {
+                long s = score(ch, now, cost_of(ch, planner, target));
+                if (best < 0 || s > best_score) {
+                    best = ch;
+                    best_score = s;
+                }
+            }
+            ch = _channels->next_available(ch);
+        } while (ch != first);
+        return best < 0 ? _current : best;
+    }
+
+    // Returns -1 if there are too many channels for a tour.
+    template <class TargetFunction>
+    int pick_in_tour(Planner *planner, TargetFunction target)
+    {
+        uint16_t chs[MAX_TOUR_CHANNELS];
+        int targets[MAX_TOUR_CHANNELS];
+        int n = 0;
+
+        // A cycle starts at the current channel, so go to another one first.
+        if (_channels->available(_current) == false) { return _channels->next_available(_current); }
+        int first = _current;
+        int ch = first;
+        do {
+            if (n >= MAX_TOUR_CHANNELS) { return -1; }
+            chs[n] = ch;
+            targets[n] = target(ch);
+            n++;
+            ch = _channels->next_available(ch);
+        } while (ch != first);
+
+        // The next cycle is planned from the state the last one leaves.
+        if (_tour.matches(chs, n) == false) {
+            _tour.plan(chs, targets, n, planner);
+            Serial.printf("The tour is planned for %d channels: %u presses per cycle, %d estimates\n", _tour.size(),
+                _tour.cycle_presses(), _tour.estimates());
+        }
+        return _tour.next(first);
+    }
+};
+
+#endif
@@ -0,0 +1,112 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _SENDERS_H_
+#define _SENDERS_H_
+
+#include <esp_now.h>
+#include <protocol.h>
+
+#define MAX_SENDERS             8
+// A bigger jump of the sequence number is a restart of the publisher, not lost frames.
+#define MAX_COUNTED_GAP         32
+
+struct Sender {
+    uint8_t mac[6];
+    const uint8_t *key;
+    ReplayWindow window;
+    // the sequence number to acknowledge from the radio task.
+    uint32_t ack_seq;
+    bool ack_pending;
+    bool used;
+    // frames lost just before the last accepted one.
+    uint32_t gap;
+};
+
+// Publishers which send framed values.
+// Paired peers are fixed. Otherwise a new sender takes the slot of the oldest one,
+// but only after its frame is verified, so that junk frames don't push out a publisher.
+class SenderTable
+{
+private:
+    Sender _senders[MAX_SENDERS];
+    bool _paired_only = false;
+    int _next = 0;
+
+public:
+
+    SenderTable()
+    {
+        for (int i = 0; i < MAX_SENDERS; i++) {
+            _senders[i] = Sender();
+        }
+    }
+
+    void pair(const PeerKey *peer)
+    {
+        if (_next >= MAX_SENDERS) { return; }
+        Sender *sender = &_senders[_next++];
+        memcpy(sender->mac, peer->mac, 6);
+        sender->key = peer->lmk;
+        sender->used = true;
+        _paired_only = true;
+    }
+
+    bool paired_only() { return _paired_only; }
+
+    // Returns NULL if the sender has no slot.
+    Sender *find(const uint8_t *mac)
+    {
+        for (int i = 0; i < MAX_SENDERS; i++) {
+            if (_senders[i].used && memcmp(_senders[i].mac, mac, 6) == 0) {
+                return &_senders[i];
+            }
+        }
+        return NULL;
+    }
+
+    // Gives a slot to a new sender. Call it after its frame is verified.
+    // Returns NULL if only paired peers are accepted.
+    Sender *claim(const uint8_t *mac)
+    {
+        if (_paired_only) { return NULL; }
+
+        Sender *sender = &_senders[_next];
+        _next = (_next + 1) % MAX_SENDERS;
+        // The peer was added to send acks. ESP-NOW takes 20 peers only, so it's removed with the slot.
+        if (sender->used && esp_now_is_peer_exist(sender->mac)) {
+            esp_now_del_peer(sender->mac);
+        }
+        *sender = Sender();
+        memcpy(sender->mac, mac, 6);
+        sender->key = frame_open_key;
+        sender->used = true;
+        return sender;
+    }
+
+    Sender *at(int i) { return &_senders[i]; }
+};
+
+#endif
@@ -0,0 +1,281 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _TIME_SERVICE_H_
+#define _TIME_SERVICE_H_
+
+#include <WiFi.h>
+#include <esp_sntp.h>
+#include <esp_timer.h>
+#include <time.h>
+
+// Re-sync when the predicted error goes over this.
+#define MAX_TIME_ERROR_US       500000LL
+// Drift is measured from the base sample to later ones. The error of the samples over the time
+// between them is the noise of a measurement, so the base is kept this long.
+#define MIN_DRIFT_BASE_US       (10 * 60 * 1000000LL)
+#define MAX_DRIFT_BASE_US       (6 * 60 * 60 * 1000000LL)
+#define MAX_SYNC_INTERVAL_US    (24 * 60 * 60 * 1000000LL)
+// a crystal before its drift is measured
+#define INITIAL_UNCERTAINTY_PPM 100.0f
+#define MIN_UNCERTAINTY_PPM     2.0f
+#define SNTP_TIMEOUT            (30 * 1000)
+#define SNTP_RETRY_INTERVAL     (5 * 60 * 1000)
+
+// Keeps the time without a Wi-Fi connection.
+// It measures the drift of the crystal between syncs, corrects the time with it,
+// and connects to Wi-Fi only when the predicted error grows over MAX_TIME_ERROR_US.
+// A sync comes from SNTP or from a time beacon over ESP-NOW.
+class TimeService
+{
+private:
+    typedef enum
+    {
+        TimeIdle,
+        TimeConnecting,
+    } state;
+
+    // NULL disables SNTP. The time comes from beacons only then.
+    const char *_ssid = NULL;
+    const char *_password = NULL;
+    long _gmt_offset = 0;
+    int _daylight_offset = 0;
+    const char *_server = NULL;
+
+    state _state = TimeIdle;
+    unsigned long _started_at = 0;
+    unsigned long _failed_at = 0;
+    bool _failed = false;
+
+    bool _synced = false;
+    // the epoch, esp_timer and the error of the source at the last sync in us.
+    int64_t _ref_epoch = 0;
+    int64_t _ref_local = 0;
+    int64_t _ref_error = 0;
+    // the sample which the drift is measured from.
+    int64_t _base_epoch = 0;
+    int64_t _base_local = 0;
+    int64_t _base_error = 0;
+    // the drift before the base. A measurement from the base is weighed against it.
+    float _prior_ppm = 0.0f;
+    float _prior_uncertainty_ppm = INITIAL_UNCERTAINTY_PPM;
+    float _drift_ppm = 0.0f;
+    float _uncertainty_ppm = INITIAL_UNCERTAINTY_PPM;
+    int64_t _last_error_us = 0;
+    uint32_t _sync_count = 0;
+
+    // A sample from the SNTP callback or the ESP-NOW receive callback.
+    // update() takes it in the loop task.
+    static portMUX_TYPE _mux;
+    static bool _sample_ready;
+    static int64_t _sample_epoch;
+    static int64_t _sample_local;
+    static int64_t _sample_error;
+
+    static void on_sntp_sync(struct timeval *tv)
+    {
+        post_sample((int64_t)tv->tv_sec * 1000000LL + tv->tv_usec, esp_timer_get_time(), 0);
+    }
+
+    void set_base(int64_t epoch_us, int64_t local_us, int64_t error_us)
+    {
+        _base_epoch = epoch_us;
+        _base_local = local_us;
+        _base_error = error_us;
+        _prior_ppm = _drift_ppm;
+        _prior_uncertainty_ppm = _uncertainty_ppm;
+    }
+
+    // Measures the drift from the base and weighs it against the prior by their variances,
+    // so a noisy measurement over a short base moves the drift only a little.
+    void calibrate(int64_t epoch_us, int64_t local_us, int64_t error_us)
+    {
+        int64_t base = local_us - _base_local;
+        if (base < MIN_DRIFT_BASE_US) { return; }
+
+        float measured_ppm = (double)((epoch_us - _base_epoch) - base) * 1e6 / base;
+        float noise_ppm = max(MIN_UNCERTAINTY_PPM, (float)((double)(error_us + _base_error) * 1e6 / base));
+        float prior_weight = 1.0f / (_prior_uncertainty_ppm * _prior_uncertainty_ppm);
+        float weight = 1.0f / (noise_ppm * noise_ppm);
+        _drift_ppm = (_prior_ppm * prior_weight + measured_ppm * weight) / (prior_weight + weight);
+        // The floor keeps it following a drift which changes with the temperature.
+        _uncertainty_ppm = max(MIN_UNCERTAINTY_PPM, 1.0f / sqrtf(prior_weight + weight));
+
+        if (base >= MAX_DRIFT_BASE_US) {
+            set_base(epoch_us, local_us, error_us);
+        }
+    }
+
+    void start_sync()
+    {
+        Serial.println("Sync the time");
+        WiFi.begin(_ssid, _password);
+        configTime(_gmt_offset, _daylight_offset, _server);
+        _state = TimeConnecting;
+        _started_at = millis();
+    }
+
+    // Frees the radio for ESP-NOW. The station mode is kept.
+    void finish_sync()
+    {
+        sntp_stop();
+        WiFi.disconnect();
+        _state = TimeIdle;
+    }
+
+public:
+
+    void begin(const char *ssid, const char *password, long gmt_offset, int daylight_offset, const char *server)
+    {
+        _ssid = ssid;
+        _password = password;
+        _gmt_offset = gmt_offset;
+        _daylight_offset = daylight_offset;
+        _server = server;
+        if (_ssid) {
+            sntp_set_time_sync_notification_cb(on_sntp_sync);
+        }
+    }
+
+    // It's safe to call from the callbacks.
+    // error_us is how far the source may be off.
+    static void post_sample(int64_t epoch_us, int64_t local_us, int64_t error_us)
+    {
+        portENTER_CRITICAL(&_mux);
+        _sample_epoch = epoch_us;
+        _sample_local = local_us;
+        _sample_error = error_us;
+        _sample_ready = true;
+        portEXIT_CRITICAL(&_mux);
+    }
+
+    bool synced() { return _synced; }
+    bool syncing() { return _state != TimeIdle; }
+    float drift_ppm() { return _drift_ppm; }
+    int64_t last_error_us() { return _last_error_us; }
+    uint32_t sync_count() { return _sync_count; }
+
+    int64_t predict(int64_t local_us)
+    {
+        int64_t elapsed = local_us - _ref_local;
+        return _ref_epoch + elapsed + (int64_t)(elapsed * (double)_drift_ppm / 1e6);
+    }
+
+    int64_t predicted_error_us(int64_t local_us)
+    {
+        return _ref_error + (int64_t)((local_us - _ref_local) * (double)_uncertainty_ppm / 1e6);
+    }
+
+    // The corrected epoch time in us.
+    int64_t now_us()
+    {
+        return predict(esp_timer_get_time());
+    }
+
+    // A sample of the true epoch time at the local time. error_us is how far the source may be off.
+    // Every sample refines the drift, but only a sample better than the prediction sets the time.
+    void on_sync(int64_t epoch_us, int64_t local_us, int64_t error_us = 0)
+    {
+        if (_synced) {
+            _last_error_us = epoch_us - predict(local_us);
+            calibrate(epoch_us, local_us, error_us);
+            if (error_us >= predicted_error_us(local_us)) { return; }
+        } else {
+            set_base(epoch_us, local_us, error_us);
+        }
+        _ref_epoch = epoch_us;
+        _ref_local = local_us;
+        _ref_error = error_us;
+        _synced = true;
+        _sync_count++;
+        Serial.printf("Time synced: error %lld us, drift %.2f ppm, uncertainty %.2f ppm\n",
+            _last_error_us, _drift_ppm, _uncertainty_ppm);
+    }
+
+    bool needs_sync()
+    {
+        if (_synced == false) { return true; }
+        int64_t local = esp_timer_get_time();
+        return predicted_error_us(local) >= MAX_TIME_ERROR_US ||
+               local - _ref_local >= MAX_SYNC_INTERVAL_US;
+    }
+
+    // Call it from loop().
+    void update()
+    {
+        bool ready;
+        int64_t epoch, local, error;
+
+        portENTER_CRITICAL(&_mux);
+        ready = _sample_ready;
+        epoch = _sample_epoch;
+        local = _sample_local;
+        error = _sample_error;
+        _sample_ready = false;
+        portEXIT_CRITICAL(&_mux);
+
+        if (ready) {
+            on_sync(epoch, local, error);
+            _failed = false;
+        }
+
+        switch (_state) {
+        case TimeIdle:
+            if (_ssid == NULL || needs_sync() == false) { break; }
+            if (_failed && millis() - _failed_at < SNTP_RETRY_INTERVAL) { break; }
+            start_sync();
+            break;
+
+        case TimeConnecting:
+            if (needs_sync() == false) {
+                finish_sync();
+            } else
+            if (millis() - _started_at >= SNTP_TIMEOUT) {
+                Serial.println("Failed to sync the time");
+                _failed = true;
+                _failed_at = millis();
+                finish_sync();
+            }
+            break;
+        }
+    }
+
+    bool get_local_time(struct tm *info)
+    {
+        if (_synced == false) { return false; }
+        // The offsets are added here, so it doesn't depend on TZ which configTime() sets.
+        time_t t = now_us() / 1000000LL + _gmt_offset + _daylight_offset;
+        gmtime_r(&t, info);
+        return true;
+    }
+};
+
+portMUX_TYPE TimeService::_mux = portMUX_INITIALIZER_UNLOCKED;
+bool TimeService::_sample_ready = false;
+int64_t TimeService::_sample_epoch = 0;
+int64_t TimeService::_sample_local = 0;
+int64_t TimeService::_sample_error = 0;
+
+#endif
@@ -0,0 +1,159 @@
+/*
+MIT License
+
+Copyright (c) 2023 Katsuyoshi Ito
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+#ifndef _TOUR_H_
+#define _TOUR_H_
+
+#include "planner.h"
+
+// The scheduler falls back to the score order if more channels are available.
+#define MAX_TOUR_CHANNELS       16
+// It finds the best order up to this number of channels, and takes the nearest one above it.
+#define EXACT_TOUR_CHANNELS     6
+
+// The order of the next rotation cycle, which shows each channel once with the fewest presses.
+// Each walk is a dry run of the planner from the state the previous one leaves, so the order
+// reuses an entered constant and each walk picks its strategy as set_value() does.
+class RotationTour
+{
+private:
+    int _size = 0;
+    uint16_t _channels[MAX_TOUR_CHANNELS];
+    // the index in _channels which was picked last.
+    int _position = 0;
+    uint8_t _order[MAX_TOUR_CHANNELS];
+    uint8_t _path[MAX_TOUR_CHANNELS];
+    uint32_t _presses = 0;
+    int _estimates = 0;
+
+    // The current channel, index 0, isn't shown again first.
+    bool allowed(int depth, int i) { return depth > 0 || i != 0; }
+
+    // Depth first with the best cycle so far as the bound.
+    void search(const Planner *state, const int *targets, int depth, uint32_t used)
+    {
+        if (state->presses() >= _presses) { return; }
+        if (depth == _size) {
+            _presses = state->presses();
+            memcpy(_order, _path, _size);
+            return;
+        }
+        for (int i = 0; i < _size; i++) {
+            if ((used & (1UL << i)) || allowed(depth, i) == false) { continue; }
+            Planner next = *state;
+            next.set_value(targets[i]);
+            _estimates++;
+            _path[depth] = i;
+            search(&next, targets, depth + 1, used | (1UL << i));
+        }
+    }
+
+    // Walks to the value with the fewest presses next.
+    void search_nearest(const Planner *start, const int *targets)
+    {
+        Planner state = *start;
+        uint32_t used = 0;
+
+        for (int depth = 0; depth < _size; depth++) {
+            int best = -1;
+            Planner best_state;
+            for (int i = 0; i < _size; i++) {
+                if ((used & (1UL << i)) || allowed(depth, i) == false) { continue; }
+                Planner next = state;
+                next.set_value(targets[i]);
+                _estimates++;
+                if (best < 0 || next.presses() < best_state.presses()) {
+                    best = i;
+                    best_state = next;
+                }
+            }
+            _order[depth] = best;
+            used |= 1UL << best;
+            state = best_state;
+        }
+        _presses = state.presses();
+    }
+
+public:
+
+    int size() { return _size; }
+    // dry runs of the planner by the last plan.
+    int estimates() { return _estimates; }
+    // presses of the planned cycle.
+    uint32_t cycle_presses() { return _presses; }
+
+    // channels[0] is the current channel, and the planner is in the state it leaves.
+    void plan(const uint16_t *channels, const int *targets, int n, const Planner *planner)
+    {
+        Planner start = planner->dry_run();
+
+        _size = min(n, MAX_TOUR_CHANNELS);
+        _estimates = 0;
+        _position = -1;
+        if (_size <= 1) {
+            _order[0] = 0;
+            _presses = 0;
+        } else {
+            // The nearest order is the bound of the search.
+            search_nearest(&start, targets);
+            if (_size <= EXACT_TOUR_CHANNELS) {
+                search(&start, targets, 0, 0);
+            }
+        }
+        for (int i = 0; i < _size; i++) {
+            _channels[i] = channels[_order[i]];
+        }
+    }
+
+    // Returns true if the cycle has channels left and they are still the available ones.
+    bool matches(const uint16_t *channels, int n)
+    {
+        if (min(n, MAX_TOUR_CHANNELS) != _size || _position >= _size - 1) { return false; }
+        for (int i = 0; i < _size; i++) {
+            if (index_of(channels[i]) < 0) { return false; }
+        }
+        return true;
+    }
+
+    int index_of(int ch)
+    {
+        for (int i = 0; i < _size; i++) {
+            if (_channels[i] == ch) { return i; }
+        }
+        return -1;
+    }
+
+    // Picks the next channel of the cycle. It skips ch, the current one.
+    int next(int ch)
+    {
+        if (_size == 0) { return ch; }
+        do {
+            _position = min(_position + 1, _size - 1);
+        } while (_channels[_position] == ch && _position < _size - 1);
+        return _channels[_position];
+    }
+};
+
+#endif
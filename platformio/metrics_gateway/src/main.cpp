@@ -0,0 +1,155 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include <esp_now.h>
+#include <esp_wifi.h>
+#include <protocol.h>
+
+// A gateway between ESP-NOW and the serial port for tools/metrics_collector.py.
+// Each frame is a line of the MAC address and the frame in hex: "aabbccddeeff c506...".
+// A line from the serial port in the same form is sent to the MAC address, e.g. a control frame.
+// Lines starting with '#' are logs.
+
+// info_calc uses the channel of its router. Set it when the router isn't on channel 1.
+#ifndef GATEWAY_CHANNEL
+#define GATEWAY_CHANNEL         1
+#endif
+
+#define FRAME_QUEUE_SIZE        16
+#define LINE_LEN                (12 + 1 + MAX_FRAME_LEN * 2 + 1)
+#define DROP_REPORT_INTERVAL    (60 * 1000)
+
+struct GatewayFrame {
+  uint8_t mac[6];
+  uint8_t len;
+  uint8_t data[MAX_FRAME_LEN];
+};
+
+static QueueHandle_t frame_queue = NULL;
+// frames which came while the queue is full.
+static volatile uint32_t dropped_frames = 0;
+
+// It runs in the Wi-Fi task, so the frame is printed in loop().
+void espnow_on_data_receive(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+  FrameHeader header;
+
+  if (frame_peek(data, data_len, &header) == false) return;
+  // The values of the publishers are not for the collector.
+  if (header.type != FrameMetrics && header.type != FrameControlReply) return;
+
+  GatewayFrame frame;
+  memcpy(frame.mac, mac_addr, 6);
+  memcpy(frame.data, data, data_len);
+  frame.len = data_len;
+  if (xQueueSend(frame_queue, &frame, 0) != pdTRUE) {
+    dropped_frames++;
+  }
+}
+
+void print_frame(const GatewayFrame *frame) {
+  char line[LINE_LEN + 1];
+  int n = 0;
+
+  for (int i = 0; i < 6; i++) {
+    n += sprintf(line + n, "%02x", frame->mac[i]);
+  }
+  line[n++] = ' ';
+  for (int i = 0; i < frame->len; i++) {
+    n += sprintf(line + n, "%02x", frame->data[i]);
+  }
+  Serial.println(line);
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Returns the number of bytes, or -1.
+static int parse_hex(const char *hex, uint8_t *out, int cap) {
+  int len = 0;
+
+  while (hex[0] && hex[0] != ' ') {
+    int high = hex_digit(hex[0]);
+    int low = hex[1] ? hex_digit(hex[1]) : -1;
+    if (high < 0 || low < 0 || len >= cap) return -1;
+    out[len++] = high << 4 | low;
+    hex += 2;
+  }
+  return len;
+}
+
+void send_line(const char *line) {
+  uint8_t mac[6];
+  uint8_t frame[MAX_FRAME_LEN];
+
+  if (line[0] == '\0' || line[0] == '#') return;
+  if (parse_hex(line, mac, sizeof(mac)) != 6 || line[12] != ' ') {
+    Serial.println("# bad line");
+    return;
+  }
+  int len = parse_hex(line + 13, frame, sizeof(frame));
+  if (len <= 0) {
+    Serial.println("# bad frame");
+    return;
+  }
+
+  if (esp_now_is_peer_exist(mac) == false) {
+    esp_now_peer_info_t peer;
+    memset(&peer, 0, sizeof(peer));
+    memcpy(peer.peer_addr, mac, 6);
+    esp_now_add_peer(&peer);
+  }
+  esp_err_t result = esp_now_send(mac, frame, len);
+  Serial.printf("# sent %d bytes: %s\n", len, result == ESP_OK ? "ok" : "failed");
+}
+
+void setup() {
+  Serial.begin(115200);
+
+  WiFi.mode(WIFI_STA);
+  WiFi.disconnect();
+  esp_wifi_set_channel(GATEWAY_CHANNEL, WIFI_SECOND_CHAN_NONE);
+  if (esp_now_init() != ESP_OK) {
+    Serial.println("# ESPNow Init Failed");
+    ESP.restart();
+  }
+
+  frame_queue = xQueueCreate(FRAME_QUEUE_SIZE, sizeof(GatewayFrame));
+  esp_now_register_recv_cb(espnow_on_data_receive);
+  Serial.printf("# gateway %s on channel %d\n", WiFi.macAddress().c_str(), GATEWAY_CHANNEL);
+}
+
+void loop() {
+  static char line[LINE_LEN];
+  static int line_len = 0;
+  static unsigned long reported_at = millis();
+  static uint32_t reported_drops = 0;
+  GatewayFrame frame;
+
+  while (xQueueReceive(frame_queue, &frame, 0) == pdTRUE) {
+    print_frame(&frame);
+  }
+
+  while (Serial.available()) {
+    char c = Serial.read();
+    if (c == '\n') {
+      line[line_len] = '\0';
+      send_line(line);
+      line_len = 0;
+    } else if (c != '\r' && line_len < LINE_LEN - 1) {
+      line[line_len++] = c;
+    }
+  }
+
+  if (millis() - reported_at >= DROP_REPORT_INTERVAL) {
+    reported_at = millis();
+    if (dropped_frames != reported_drops) {
+      reported_drops = dropped_frames;
+      Serial.printf("# dropped %u frames\n", reported_drops);
+    }
+  }
+
+  delay(1);
+}
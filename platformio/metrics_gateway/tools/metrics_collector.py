@@ -0,0 +1,225 @@
+#!/usr/bin/env python3
+"""Decodes the metrics frames of info_calc from the serial port of metrics_gateway.
+
+    python3 metrics_collector.py /dev/ttyUSB0 --csv metrics.csv
+    python3 metrics_collector.py - < captured.txt
+
+The layout follows MetricsPayload of platformio/common/info_calc_protocol/protocol.h.
+pyserial is needed for a serial port.
+"""
+
+import argparse
+import csv
+import struct
+import sys
+import time
+
+FRAME_MAGIC = 0xC5
+FRAME_TAG_LEN = 8
+FRAME_HEADER = struct.Struct("<BBI")
+
+FRAME_CONTROL_REPLY = 5
+FRAME_METRICS = 6
+
+METRICS_VERSION = 1
+METRICS_LATENCY_BUCKETS = 8
+METRICS = struct.Struct("<BIII8HHIHHHIIHHHHHIIB")
+CHANNEL = struct.Struct("<BHHb")
+CONTROL_REPLY = struct.Struct("<IIBB")
+CONTROL_STATUS = ["applied", "stale", "invalid", "not stored"]
+
+# Warnings for a regression. The stacks are in bytes.
+LOW_STACK = 512
+LOW_HEAP = 20 * 1024
+# loop() iterations at 16 ms or longer
+SLOW_LOOP_BUCKET = 5
+
+MASK = (1 << 64) - 1
+
+
+def rotl(x, b):
+    return ((x << b) | (x >> (64 - b))) & MASK
+
+
+def sip_round(v0, v1, v2, v3):
+    v0 = (v0 + v1) & MASK; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32)
+    v2 = (v2 + v3) & MASK; v3 = rotl(v3, 16); v3 ^= v2
+    v0 = (v0 + v3) & MASK; v3 = rotl(v3, 21); v3 ^= v0
+    v2 = (v2 + v1) & MASK; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32)
+    return v0, v1, v2, v3
+
+
+def siphash24(key, data):
+    k0, k1 = struct.unpack("<QQ", key)
+    v0 = 0x736f6d6570736575 ^ k0
+    v1 = 0x646f72616e646f6d ^ k1
+    v2 = 0x6c7967656e657261 ^ k0
+    v3 = 0x7465646279746573 ^ k1
+    end = len(data) - len(data) % 8
+    for i in range(0, end, 8):
+        m, = struct.unpack_from("<Q", data, i)
+        v3 ^= m
+        v0, v1, v2, v3 = sip_round(v0, v1, v2, v3)
+        v0, v1, v2, v3 = sip_round(v0, v1, v2, v3)
+        v0 ^= m
+    m = (len(data) & 0xff) << 56
+    for i, b in enumerate(data[end:]):
+        m |= b << (i * 8)
+    v3 ^= m
+    v0, v1, v2, v3 = sip_round(v0, v1, v2, v3)
+    v0, v1, v2, v3 = sip_round(v0, v1, v2, v3)
+    v0 ^= m
+    v2 ^= 0xff
+    for _ in range(4):
+        v0, v1, v2, v3 = sip_round(v0, v1, v2, v3)
+    return v0 ^ v1 ^ v2 ^ v3
+
+
+def open_frame(frame, key):
+    """Returns (type, seq, payload), or None if the frame is broken."""
+    if len(frame) < FRAME_HEADER.size + FRAME_TAG_LEN or frame[0] != FRAME_MAGIC:
+        return None
+    body, tag = frame[:-FRAME_TAG_LEN], frame[-FRAME_TAG_LEN:]
+    if struct.pack("<Q", siphash24(key, body)) != tag:
+        return None
+    _, frame_type, seq = FRAME_HEADER.unpack_from(body)
+    return frame_type, seq, body[FRAME_HEADER.size:]
+
+
+def decode_metrics(payload):
+    if len(payload) < METRICS.size:
+        return None
+    fields = METRICS.unpack_from(payload)
+    if fields[0] != METRICS_VERSION:
+        return None
+    m = {
+        "uptime_s": fields[1],
+        "interval_ms": fields[2],
+        "config_revision": fields[3],
+        "loop_latency": list(fields[4:4 + METRICS_LATENCY_BUCKETS]),
+    }
+    names = ["max_loop_ms", "presses", "presses_per_hour", "resyncs", "drifts", "heap_free", "heap_min",
+             "stack_radio", "stack_actuator", "stack_led", "stack_loop", "stack_light",
+             "queue_dropped", "rejected", "channel_count"]
+    m.update(zip(names, fields[4 + METRICS_LATENCY_BUCKETS:]))
+    if len(payload) != METRICS.size + m["channel_count"] * CHANNEL.size:
+        return None
+    m["channels"] = [CHANNEL.unpack_from(payload, METRICS.size + i * CHANNEL.size)
+                     for i in range(m["channel_count"])]
+    return m
+
+
+def warnings_of(m, last):
+    warnings = []
+    stacks = [m[k] for k in ("stack_radio", "stack_actuator", "stack_led", "stack_loop", "stack_light")]
+    if min(stacks) < LOW_STACK:
+        warnings.append("low stack")
+    if m["heap_min"] < LOW_HEAP:
+        warnings.append("low heap")
+    if sum(m["loop_latency"][SLOW_LOOP_BUCKET:]):
+        warnings.append("slow loop")
+    if last and m["uptime_s"] < last["uptime_s"]:
+        warnings.append("rebooted")
+    if last and m["queue_dropped"] > last["queue_dropped"]:
+        warnings.append("queue full")
+    return warnings
+
+
+def latency_text(buckets):
+    edges = ["<1", "<2", "<4", "<8", "<16", "<32", "<64", ">=64"]
+    return " ".join("%s:%d" % (e, n) for e, n in zip(edges, buckets) if n)
+
+
+def print_metrics(mac, m, warnings):
+    print("%s up %dh%02dm rev %d | loop %s ms, max %d ms | presses %d (%d/h), resyncs %d, drifts %d"
+          % (mac, m["uptime_s"] // 3600, m["uptime_s"] // 60 % 60, m["config_revision"],
+             latency_text(m["loop_latency"]), m["max_loop_ms"], m["presses"], m["presses_per_hour"],
+             m["resyncs"], m["drifts"]))
+    print("  heap %d (min %d) | stack radio %d, actuator %d, led %d, loop %d, light %d | dropped %d, rejected %d"
+          % (m["heap_free"], m["heap_min"], m["stack_radio"], m["stack_actuator"], m["stack_led"],
+             m["stack_loop"], m["stack_light"], m["queue_dropped"], m["rejected"]))
+    for ch, received, lost, rssi in m["channels"]:
+        drop = lost * 100 // (received + lost) if received + lost else 0
+        print("  ch%d: received %d, lost %d (%d%%), rssi %s"
+              % (ch, received, lost, drop, "%d dBm" % rssi if rssi else "-"))
+    if warnings:
+        print("  WARNING: " + ", ".join(warnings))
+
+
+def csv_row(mac, m, warnings):
+    row = [time.strftime("%Y-%m-%d %H:%M:%S"), mac]
+    row += [m[k] for k in ("uptime_s", "interval_ms", "config_revision")]
+    row += m["loop_latency"]
+    row += [m[k] for k in ("max_loop_ms", "presses", "presses_per_hour", "resyncs", "drifts", "heap_free",
+                           "heap_min", "stack_radio", "stack_actuator", "stack_led", "stack_loop", "stack_light",
+                           "queue_dropped", "rejected")]
+    row.append(" ".join("%d:%d/%d/%d" % c for c in m["channels"]))
+    row.append(" ".join(warnings))
+    return row
+
+
+def lines_of(port, baud):
+    if port == "-":
+        yield from sys.stdin
+        return
+    import serial
+    with serial.Serial(port, baud, timeout=1) as s:
+        while True:
+            line = s.readline()
+            if line:
+                yield line.decode("ascii", "replace")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port", help="serial port of metrics_gateway, or - for stdin")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--key", default="00" * 16,
+                        help="admin_key of info_calc in hex if ADMIN_CONTROL is defined")
+    parser.add_argument("--csv", help="append the reports to this file")
+    args = parser.parse_args()
+
+    key = bytes.fromhex(args.key)
+    if len(key) != 16:
+        parser.error("the key is 16 bytes")
+    last = {}
+    out = open(args.csv, "a", newline="") if args.csv else None
+    writer = csv.writer(out) if out else None
+
+    for line in lines_of(args.port, args.baud):
+        line = line.strip()
+        if not line or line.startswith("#"):
+            if line:
+                print(line)
+            continue
+        try:
+            mac, frame = line.split(" ", 1)
+            frame = bytes.fromhex(frame)
+        except ValueError:
+            continue
+        opened = open_frame(frame, key)
+        if opened is None:
+            print("%s: a broken frame or another key" % mac)
+            continue
+        frame_type, seq, payload = opened
+
+        if frame_type == FRAME_CONTROL_REPLY and len(payload) == CONTROL_REPLY.size:
+            reply_seq, revision, status, item = CONTROL_REPLY.unpack(payload)
+            status_text = CONTROL_STATUS[status] if status < len(CONTROL_STATUS) else str(status)
+            print("%s control %d: %s, revision %d, item %d" % (mac, reply_seq, status_text, revision, item))
+        elif frame_type == FRAME_METRICS:
+            m = decode_metrics(payload)
+            if m is None:
+                print("%s: unknown metrics version or length" % mac)
+                continue
+            warnings = warnings_of(m, last.get(mac))
+            print_metrics(mac, m, warnings)
+            if writer:
+                writer.writerow(csv_row(mac, m, warnings))
+                out.flush()
+            last[mac] = m
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
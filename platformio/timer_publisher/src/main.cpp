@@ -3,6 +3,12 @@
 #include <WiFi.h>
 #include <esp_now.h>
 #include <EEPROM.h>
+#include <sys/time.h>
+#include <protocol.h>
+#include <publisher.h>
+#if defined(SECURE_ESPNOW) || defined(RELIABLE_ESPNOW) || defined(TIME_BEACON)
+#include "env.h"
+#endif
 
 EEPROMClass  eeprom("eeprom");
 
@@ -14,6 +20,42 @@ static int minitus = 1;
 static int remains = minitus * 600;
 static int preset = minitus * 600;
 
+#define SETTINGS_MINITUS        0
+// The limit of the sequence numbers. See Publisher.
+#define SETTINGS_SEQ_LIMIT      4
+
+#ifdef SECURE_ESPNOW
+static const uint8_t *frame_key = display_key.lmk;
+#else
+static const uint8_t *frame_key = frame_open_key;
+#endif
+
+#ifdef RELIABLE_ESPNOW
+static const bool reliable = true;
+#else
+static const bool reliable = false;
+#endif
+static Publisher publisher;
+
+#ifdef RELIABLE_ESPNOW
+// set by the receive callback and handled in loop().
+static volatile bool ack_received = false;
+static volatile uint32_t acked_seq = 0;
+static volatile unsigned long acked_at = 0;
+#endif
+
+#ifdef TIME_BEACON
+// It broadcasts the time, so info_calc keeps the time without a router.
+#define TIME_BEACON_INTERVAL    (10 * 1000)
+#define SNTP_ERROR_MS           100
+// The RTC counts seconds.
+#define RTC_ERROR_MS            1000
+// 20 ppm of the RTC
+#define DRIFT_MS_PER_SECOND     0.02f
+static uint32_t time_error_ms = 0;
+static unsigned long time_set_at = 0;
+#endif
+
 // @refer https://it-evo.jp/blog/blog-1397/
 void espnow_on_data_sent(const uint8_t *mac_addr, esp_now_send_status_t status) {
   char macStr[18];
@@ -26,6 +68,44 @@ void espnow_on_data_sent(const uint8_t *mac_addr, esp_now_send_status_t status)
 }
 
 
+esp_err_t espnow_send_frame(const uint8_t *frame, size_t len) {
+  esp_err_t result = esp_now_send(espnow_slave.peer_addr, frame, len);
+  Serial.print("Send Status: ");
+  if (result == ESP_OK) {
+    Serial.println("Success");
+  } else if (result == ESP_ERR_ESPNOW_NOT_INIT) {
+    Serial.println("ESPNOW not Init.");
+  } else if (result == ESP_ERR_ESPNOW_ARG) {
+    Serial.println("Invalid Argument");
+  } else if (result == ESP_ERR_ESPNOW_INTERNAL) {
+    Serial.println("Internal Error");
+  } else if (result == ESP_ERR_ESPNOW_NO_MEM) {
+    Serial.println("ESP_ERR_ESPNOW_NO_MEM");
+  } else if (result == ESP_ERR_ESPNOW_NOT_FOUND) {
+    Serial.println("Peer not found.");
+  } else {
+    Serial.println("Not sure what happened");
+  }
+  return result;
+}
+
+bool espnow_transmit(const uint8_t *frame, size_t len) {
+  return espnow_send_frame(frame, len) == ESP_OK;
+}
+
+#ifdef RELIABLE_ESPNOW
+void espnow_on_data_receive(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+  uint32_t seq;
+
+  if (memcmp(mac_addr, display_key.mac, 6) != 0) return;
+  if (publisher.read_ack(data, data_len, &seq) == false) return;
+
+  acked_seq = seq;
+  acked_at = millis();
+  ack_received = true;
+}
+#endif
+
 void espnow_setup() {
   WiFi.mode(WIFI_STA);
   WiFi.disconnect();
@@ -37,9 +117,20 @@ void espnow_setup() {
   }
 
   memset(&espnow_slave, 0, sizeof(espnow_slave));
+#ifdef SECURE_ESPNOW
+  // Encrypted frames can be sent to a paired peer only.
+  esp_now_set_pmk(espnow_pmk);
+  memcpy(espnow_slave.peer_addr, display_key.mac, 6);
+  memcpy(espnow_slave.lmk, display_key.lmk, ESP_NOW_KEY_LEN);
+  espnow_slave.encrypt = true;
+#elif defined(RELIABLE_ESPNOW)
+  // Acknowledgements come back to unicast frames only.
+  memcpy(espnow_slave.peer_addr, display_key.mac, 6);
+#else
   for (int i = 0; i < 6; ++i) {
     espnow_slave.peer_addr[i] = (uint8_t)0xff;
   }
+#endif
   
   esp_err_t addStatus = esp_now_add_peer(&espnow_slave);
   if (addStatus == ESP_OK) {
@@ -47,6 +138,9 @@ void espnow_setup() {
   }
 
   esp_now_register_send_cb(espnow_on_data_sent);
+#ifdef RELIABLE_ESPNOW
+  esp_now_register_recv_cb(espnow_on_data_receive);
+#endif
 }
 
 void espnow_teardown()
@@ -55,29 +149,72 @@ void espnow_teardown()
   WiFi.mode(WIFI_OFF);
 }
 
-void espnow_send(int ch, float value, char *unit) {
+void store_seq_limit(uint32_t limit) {
+  eeprom.put(SETTINGS_SEQ_LIMIT, limit);
+  eeprom.commit();
+}
+
+// value is in hundredths.
+void espnow_send(int ch, int32_t value, const char *unit) {
   char str[64] = {};
-  sprintf(str, "%i,%5.3f,%s", ch, value, unit);
+  format_value_payload(str, sizeof(str), ch, value, unit);
 Serial.println(str);
-  esp_err_t result = esp_now_send(espnow_slave.peer_addr, (uint8_t *)str, strlen(str));
-  Serial.print("Send Status: ");
-  if (result == ESP_OK) {
-    Serial.println("Success");
-  } else if (result == ESP_ERR_ESPNOW_NOT_INIT) {
-    Serial.println("ESPNOW not Init.");
-  } else if (result == ESP_ERR_ESPNOW_ARG) {
-    Serial.println("Invalid Argument");
-  } else if (result == ESP_ERR_ESPNOW_INTERNAL) {
-    Serial.println("Internal Error");
-  } else if (result == ESP_ERR_ESPNOW_NO_MEM) {
-    Serial.println("ESP_ERR_ESPNOW_NO_MEM");
-  } else if (result == ESP_ERR_ESPNOW_NOT_FOUND) {
-    Serial.println("Peer not found.");
+#if defined(SECURE_ESPNOW) || defined(RELIABLE_ESPNOW)
+  publisher.send_value(ch, value, unit, millis());
+#else
+  espnow_send_frame((uint8_t *)str, strlen(str));
+#endif
+}
+
+#ifdef TIME_BEACON
+// Sets the time by SNTP and keeps it in the RTC. The RTC is used when there is no router.
+void beacon_setup_time() {
+  WiFi.begin(ssid, password);
+  configTime(0, 0, "ntp.nict.jp");
+
+  struct tm info;
+  bool synced = false;
+  unsigned long started_at = millis();
+  while (millis() - started_at < 20 * 1000) {
+    // getLocalTime() waits until the year is set.
+    if (WiFi.status() == WL_CONNECTED && getLocalTime(&info, 1000)) {
+      synced = true;
+      break;
+    }
+    delay(500);
+  }
+
+  if (synced) {
+    Serial.println("The time is set by SNTP");
+    M5.Rtc.setDateTime(&info);
+    time_error_ms = SNTP_ERROR_MS;
   } else {
-    Serial.println("Not sure what happened");
+    Serial.println("The time is read from the RTC");
+    info = M5.Rtc.getDateTime().get_tm();
+    struct timeval tv = { mktime(&info), 0 };
+    settimeofday(&tv, NULL);
+    time_error_ms = RTC_ERROR_MS;
   }
+  time_set_at = millis();
+  WiFi.disconnect();
 }
 
+void espnow_send_time() {
+  TimePayload beacon;
+  struct timeval tv;
+
+  beacon.error_ms = time_error_ms + (uint32_t)((millis() - time_set_at) / 1000 * DRIFT_MS_PER_SECOND);
+  uint8_t frame[MAX_FRAME_LEN];
+  // next_seq() may write the EEPROM, so take the seq first.
+  uint32_t frame_seq = publisher.next_seq();
+  // It's stamped just before sending. A retransmitted beacon would be late, so it's never sent again.
+  gettimeofday(&tv, NULL);
+  beacon.epoch_us = (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+  size_t len = frame_seal(frame, sizeof(frame), FrameTime, frame_seq, &beacon, sizeof(beacon), frame_key);
+  espnow_send_frame(frame, len);
+}
+#endif
+
 void set_minitus(int m) {
   minitus = m;
   remains = minitus * 60 * 10;
@@ -86,15 +223,19 @@ void set_minitus(int m) {
 
 void load_settings() {
     int m;
-    eeprom.get(0, m);
+    eeprom.get(SETTINGS_MINITUS, m);
     set_minitus(max(1, minitus));
+
+    uint32_t seq_limit;
+    eeprom.get(SETTINGS_SEQ_LIMIT, seq_limit);
+    publisher.begin(frame_key, seq_limit, store_seq_limit, espnow_transmit, reliable);
 }
 
 void store_settings() {
     int m;
-    eeprom.get(0, m);
+    eeprom.get(SETTINGS_MINITUS, m);
     if (m != minitus) {
-        eeprom.put(0, minitus);
+        eeprom.put(SETTINGS_MINITUS, minitus);
         eeprom.commit();
     }
 }
@@ -121,9 +262,13 @@ void setup() {
   M5.Lcd.setRotation(1);
   M5.Lcd.setTextSize(3);
 
-  eeprom.begin(4);
+  eeprom.begin(8);
   load_settings();
 
+#ifdef TIME_BEACON
+  beacon_setup_time();
+#endif
+
   espnow_setup();
   display();
 
@@ -173,8 +318,8 @@ void loop() {
         int v = remains / 10;
         int m = v / 60;
         int s = v % 60;
-        float f = (float)m + (float)s * 0.01;
-        espnow_send(3, f, "timer");
+        // 4:59 is sent as 4.59.
+        espnow_send(3, m * 100 + s, "timer");
         display();
       }
 
@@ -187,13 +332,32 @@ void loop() {
     }
   }
 
+#ifdef TIME_BEACON
+  static unsigned long beacon_at = millis() - TIME_BEACON_INTERVAL;
+  if (now - beacon_at >= TIME_BEACON_INTERVAL) {
+    beacon_at = now;
+    espnow_send_time();
+  }
+#endif
+
+#ifdef RELIABLE_ESPNOW
+  if (ack_received) {
+    ack_received = false;
+    publisher.on_ack(acked_seq, acked_at);
+  }
+  publisher.update(millis());
+#endif
+
   // The device will automatically power off after two minutes when the timer stops.
+  // A time beacon keeps running.
+#ifndef TIME_BEACON
   if (started) {
     stopped_at = millis();
   }
   if (millis() - stopped_at >= 2 * 60 * 1000) {
     M5.Power.powerOff();
   }
+#endif
 
   delay(10);
 }